@@ -0,0 +1,130 @@
+/* bench_scan.c
+ * 功能：linescan.h 行尾掃描器的 microbenchmark
+ *
+ * 行為：
+ *   1) 產生 1 MiB 的可印字元資料，每隔固定長度放一個 '\n'（模擬不同長度的聊天訊息）。
+ *   2) 對每種實作重複「從頭找到尾、每找到一個行尾就從下一個 byte 繼續」，
+ *      量測每個 cycle 掃過幾個 bytes（x86 用 rdtsc，其他平台以 ns 代替）。
+ *   3) 比較對象：
+ *       memchr    -> 只找 '\n'（glibc 的向量化版本，只能找一種字元，當作上限參考）
+ *       memchr x2 -> 分別找 '\n' 與 '\r' 取較前者，等於 scan_eol 的語意（實際要比的對象）
+ *       bytes     -> 逐 byte 比對
+ *       scalar    -> SWAR，一次 8 bytes
+ *       sse2/avx2 -> SIMD 版本（CPU 支援時）
+ *
+ * 編譯： gcc -O2 -Wall -Wextra -o bench_scan bench_scan.c
+ * 使用： ./bench_scan [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "linescan.h"
+
+#define DATA_SIZE (1 << 20)   // 測試資料大小
+
+// 讀取時間戳記：x86 使用 TSC cycle，其他平台使用 ns
+static inline unsigned long long ticks(void) {
+#ifdef LINESCAN_X86
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static const char *scan_memchr_nl(const char *p, size_t n) {
+    return memchr(p, '\n', n);
+}
+
+static const char *scan_memchr2(const char *p, size_t n) {
+    const char *a = memchr(p, '\n', n);
+    const char *b = memchr(p, '\r', a ? (size_t)(a - p) : n); // 只需要找到 a 之前
+    return b ? b : a;
+}
+
+struct impl {
+    const char *name;
+    scan_eol_fn fn;
+};
+
+// 掃過整個 buffer，回傳行數（避免被編譯器最佳化掉）
+static size_t scan_all(scan_eol_fn fn, const char *buf, size_t n) {
+    const char *p = buf, *end = buf + n;
+    size_t lines = 0;
+    while (p < end) {
+        const char *eol = fn(p, (size_t)(end - p));
+        if (!eol) break;
+        lines++;
+        p = eol + 1;
+    }
+    return lines;
+}
+
+int main(int argc, char **argv) {
+    int rounds = (argc >= 2) ? atoi(argv[1]) : 200;
+    if (rounds < 1) rounds = 1;
+
+    linescan_init();
+
+    struct impl impls[8];
+    int nimpl = 0;
+    impls[nimpl++] = (struct impl){ "memchr",    scan_memchr_nl };
+    impls[nimpl++] = (struct impl){ "memchr x2", scan_memchr2 };
+    impls[nimpl++] = (struct impl){ "bytes",     scan_eol_bytes };
+    impls[nimpl++] = (struct impl){ "scalar",    scan_eol_scalar };
+#ifdef LINESCAN_X86
+    if (__builtin_cpu_supports("sse2")) impls[nimpl++] = (struct impl){ "sse2", scan_eol_sse2 };
+    if (__builtin_cpu_supports("avx2")) impls[nimpl++] = (struct impl){ "avx2", scan_eol_avx2 };
+#endif
+
+    char *buf = malloc(DATA_SIZE);
+    if (!buf) { perror("malloc"); return 1; }
+
+    // 訊息長度：短聊天、一般聊天、長訊息、以及完全沒有換行（純掃描吞吐量）
+    static const size_t line_lens[] = { 32, 128, 1024, 0 };
+
+    printf("runtime choice: %s\n", scan_eol_impl_name);
+    printf("%-10s", "line len");
+    for (int k = 0; k < nimpl; k++) printf(" %10s", impls[k].name);
+    printf("   (bytes/%s)\n",
+#ifdef LINESCAN_X86
+           "cycle"
+#else
+           "ns"
+#endif
+    );
+
+    srand(1);
+    for (size_t li = 0; li < sizeof(line_lens) / sizeof(line_lens[0]); li++) {
+        size_t len = line_lens[li];
+        for (size_t i = 0; i < DATA_SIZE; i++) {
+            buf[i] = (char)(' ' + rand() % 95);
+            if (len && i % len == len - 1) buf[i] = '\n';
+        }
+
+        if (len) printf("%-10zu", len);
+        else     printf("%-10s", "none");
+        size_t expect = scan_all(scan_eol_bytes, buf, DATA_SIZE);
+        for (int k = 0; k < nimpl; k++) {
+            // 先跑一次暖身並驗證結果
+            if (scan_all(impls[k].fn, buf, DATA_SIZE) != expect) {
+                printf(" %10s", "MISMATCH");
+                continue;
+            }
+            unsigned long long t0 = ticks();
+            size_t sink = 0;
+            for (int r = 0; r < rounds; r++) sink += scan_all(impls[k].fn, buf, DATA_SIZE);
+            unsigned long long dt = ticks() - t0;
+            if (sink != expect * (size_t)rounds) printf("!");
+            printf(" %10.2f", (double)DATA_SIZE * rounds / (double)(dt ? dt : 1));
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    return 0;
+}
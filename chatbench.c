@@ -0,0 +1,381 @@
+/* chatbench.c
+ * 功能：聊天室 Server 的負載產生器（從 client.c 衍生，一個 process 開大量連線）
+ *
+ * 行為：
+ *   1) 以非阻塞 connect 一次開 -c 條連線，全部用同一個 epoll 管理；連上後先送 "NICK b<編號>\n"。
+ *   2) 前 -s 條連線是「發話者」，每條每秒送 -r 則訊息、每則 -l bytes。
+ *      訊息開頭帶有送出當下的 CLOCK_MONOTONIC 時間戳記："@<16 位十六進位 ns> <填充字元>"。
+ *   3) 所有連線都會收到 server 廣播的 "[name] @<ts> ...\n"，以 linescan.h 分行，
+ *      收到時間減去時間戳記就是該則訊息從送出到扇出 (fan-out) 給這個收件者的端到端延遲。
+ *      server 閒置檢查送來的 "PING <token>" 會自動回覆 "PONG <token>"。
+ *   4) 每秒印出送出/收到的訊息數，結束時印出總吞吐量 (delivered msgs/s) 與延遲的
+ *      p50 / p99 / p999 / max。暖身期 (-w 秒) 內的延遲不列入統計。
+ *
+ * 注意：
+ *   - 發話者與收件者在同一台機器上，才能直接比較 CLOCK_MONOTONIC。
+ *   - 上一則訊息還沒完全寫進 socket 時不會再塞新訊息（記為 stalled），避免 client 端自己排隊
+ *     讓延遲失真；stalled 大於 0 代表 server 讀不夠快。
+ *   - 連線數超過 RLIMIT_NOFILE 時會先嘗試把 soft limit 提高到 hard limit。
+ *
+ * 編譯： gcc -O2 -Wall -Wextra -o chatbench chatbench.c
+ * 使用： ./chatbench <server-host> <port> [-c conns] [-s senders] [-r rate] [-l size]
+ *                    [-d seconds] [-w warmup-seconds]
+ *
+ * 範例：
+ *   ./chatbench 127.0.0.1 12345 -c 1000 -s 50 -r 20 -l 64 -d 10
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "linescan.h"
+
+#define BUFSIZE    4096   // 每條連線的接收緩衝區大小
+#define MAX_EVENTS 1024   // 每次 epoll_wait 最多取回的事件數
+#define MAX_SIZE   1024   // 單則訊息的最大長度（含 "\n"）
+
+// 延遲直方圖：以 ns 為單位，每個 2 的次方區間再細分 HIST_SUB 格（相對誤差約 1/HIST_SUB）
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+// 每條連線的狀態
+struct conn {
+    int fd;
+    int connected;
+    int sender;                 // 是否為發話者
+    uint64_t next_send;         // 下一則訊息預定送出的時間 (ns)
+    char out[MAX_SIZE];         // 還沒寫進 socket 的部分
+    size_t outlen, outoff;
+    char in[BUFSIZE];           // 還沒收到行尾的半行
+    size_t inlen;
+};
+
+static uint64_t hist[HIST_BUCKETS];
+static uint64_t hist_count, hist_max;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (unsigned)v;
+    unsigned msb = 63 - (unsigned)__builtin_clzll(v);
+    unsigned shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (unsigned)((v >> shift) & (HIST_SUB - 1));
+}
+
+// 區間的代表值（區間上緣）
+static uint64_t hist_value(unsigned b) {
+    if (b < HIST_SUB) return b;
+    unsigned shift = b / HIST_SUB - 1;
+    uint64_t sub = b % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+static void hist_add(uint64_t v) {
+    hist[hist_bucket(v)]++;
+    hist_count++;
+    if (v > hist_max) hist_max = v;
+}
+
+static uint64_t hist_percentile(double p) {
+    if (hist_count == 0) return 0;
+    uint64_t want = (uint64_t)(p * (double)hist_count);
+    if (want >= hist_count) want = hist_count - 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want) return hist_value(b) < hist_max ? hist_value(b) : hist_max;
+    }
+    return hist_max;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s <server-host> <port> [-c conns] [-s senders] [-r rate] [-l size]\n"
+                    "          [-d seconds] [-w warmup-seconds]\n", prog);
+}
+
+// 把連線的 epoll 事件設為只讀或讀寫
+static void watch(int epfd, struct conn *c, int idx, int want_out) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.u32 = (uint32_t)idx;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// 盡量把 c->out 寫進 socket；回傳 -1 表示連線錯誤
+static int flush_out(struct conn *c) {
+    while (c->outoff < c->outlen) {
+        ssize_t n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->outoff += (size_t)n;
+    }
+    c->outlen = c->outoff = 0;
+    return 0;
+}
+
+// 處理收到的一行：找出 "] @<ts>"，回傳 1 表示是帶時間戳記的測試訊息
+static int handle_line(const char *p, size_t n, uint64_t now, uint64_t warm_until) {
+    const char *at = memchr(p, ']', n);
+    if (!at || (size_t)(at - p) + 19 > n || at[1] != ' ' || at[2] != '@') return 0;
+    uint64_t ts = 0;
+    for (int k = 0; k < 16; k++) {
+        char ch = at[3 + k];
+        int d = (ch >= '0' && ch <= '9') ? ch - '0' : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10 : -1;
+        if (d < 0) return 0;
+        ts = ts << 4 | (uint64_t)d;
+    }
+    if (ts >= warm_until && now >= ts) hist_add(now - ts);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) { usage(argv[0]); return 1; }
+    const char *host = argv[1];
+    const char *port = argv[2];
+
+    int nconns = 100, nsenders = 10, rate = 10, size = 64, duration = 10, warmup = 1;
+    int opt;
+    optind = 3;
+    while ((opt = getopt(argc, argv, "c:s:r:l:d:w:")) != -1) {
+        switch (opt) {
+        case 'c': nconns   = atoi(optarg); break;
+        case 's': nsenders = atoi(optarg); break;
+        case 'r': rate     = atoi(optarg); break;
+        case 'l': size     = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'w': warmup   = atoi(optarg); break;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+    if (nconns < 1 || nsenders < 0 || rate < 1 || duration < 1 || warmup < 0) { usage(argv[0]); return 1; }
+    if (nsenders > nconns) nsenders = nconns;
+    if (size < 20) size = 20;                 // "@" + 16 位時間戳記 + " " + "\n" 至少 19 bytes
+    if (size > MAX_SIZE) size = MAX_SIZE;
+
+    linescan_init();
+
+    // 連線數多時先提高 fd 上限
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nconns + 16) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) perror("setrlimit");
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int gai = getaddrinfo(host, port, &hints, &res);
+    if (gai != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai));
+        return 1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { perror("epoll_create1"); return 1; }
+
+    struct conn *conns = calloc((size_t)nconns, sizeof(*conns));
+    if (!conns) { perror("calloc"); return 1; }
+
+    // ----------- 開啟所有連線（非阻塞 connect，連上時會收到 EPOLLOUT） -----------
+    int opened = 0;
+    for (int i = 0; i < nconns; i++) {
+        struct conn *c = &conns[i];
+        c->fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+        if (c->fd < 0) { perror("socket"); break; }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(c->fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            perror("connect");
+            close(c->fd);
+            c->fd = -1;
+            break;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN | EPOLLOUT;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        c->sender = i < nsenders;
+        opened++;
+    }
+    freeaddrinfo(res);
+    if (opened < nconns) {
+        fprintf(stderr, "only %d of %d connections opened\n", opened, nconns);
+        nconns = opened;
+        if (nsenders > nconns) nsenders = nconns;
+    }
+    if (nconns == 0) return 1;
+
+    printf("chatbench: %d conns, %d senders x %d msg/s, %d bytes/msg, %ds (+%ds warmup)\n",
+           nconns, nsenders, rate, size, duration, warmup);
+    fflush(stdout);
+
+    // ----------- 主迴圈 -----------
+    uint64_t interval = 1000000000ULL / (uint64_t)rate;
+    uint64_t start = now_ns();
+    uint64_t warm_until = start + (uint64_t)warmup * 1000000000ULL;
+    uint64_t end = warm_until + (uint64_t)duration * 1000000000ULL;
+    uint64_t next_report = start + 1000000000ULL;
+    uint64_t sent = 0, delivered = 0, stalled = 0, other = 0;
+    uint64_t sent_tick = 0, delivered_tick = 0;
+    uint64_t sent_measured = 0, delivered_measured = 0;
+    int nconnected = 0, nclosed = 0;
+
+    // 讓發話者的送出時間錯開，避免每個 interval 開頭同時爆量
+    for (int i = 0; i < nsenders; i++) conns[i].next_send = start + interval * (uint64_t)i / (uint64_t)nsenders;
+
+    char line[MAX_SIZE];
+    memset(line, 'x', sizeof(line));
+
+    struct epoll_event evs[MAX_EVENTS];
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= end) break;
+
+        // --- 1. 送出到期的訊息 ---
+        for (int i = 0; i < nsenders; i++) {
+            struct conn *c = &conns[i];
+            if (!c->connected || c->fd < 0) continue;
+            while (c->next_send <= now) {
+                c->next_send += interval;
+                if (c->outlen > 0) { stalled++; continue; } // 上一則還沒寫完
+                int n = snprintf(c->out, sizeof(c->out), "@%016llx ", (unsigned long long)now_ns());
+                memcpy(c->out + n, line, (size_t)(size - n - 1));
+                c->out[size - 1] = '\n';
+                c->outlen = (size_t)size;
+                c->outoff = 0;
+                sent++;
+                sent_tick++;
+                if (now >= warm_until) sent_measured++;
+                if (flush_out(c) < 0) {
+                    close(c->fd); c->fd = -1; nclosed++;
+                    break;
+                }
+                if (c->outlen > 0) watch(epfd, c, i, 1);
+            }
+        }
+
+        // --- 2. 每秒報告一次 ---
+        if (now >= next_report) {
+            printf("%4.0fs  conns %d/%d  sent %8llu/s  delivered %10llu/s\n",
+                   (double)(now - start) / 1e9, nconnected - nclosed, nconns,
+                   (unsigned long long)sent_tick, (unsigned long long)delivered_tick);
+            fflush(stdout);
+            sent_tick = delivered_tick = 0;
+            next_report += 1000000000ULL;
+        }
+
+        // --- 3. 等待事件，最多等到下一個 1ms ---
+        int nready = epoll_wait(epfd, evs, MAX_EVENTS, 1);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int k = 0; k < nready; k++) {
+            int i = (int)evs[k].data.u32;
+            struct conn *c = &conns[i];
+            if (c->fd < 0) continue;
+            uint32_t e = evs[k].events;
+
+            if (!c->connected && (e & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t elen = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+                if (err) {
+                    fprintf(stderr, "connect: %s\n", strerror(err));
+                    close(c->fd); c->fd = -1; nclosed++;
+                    continue;
+                }
+                c->connected = 1;
+                nconnected++;
+                c->outlen = (size_t)snprintf(c->out, sizeof(c->out), "NICK b%d\n", i);
+                c->outoff = 0;
+            }
+
+            if (e & EPOLLOUT) {
+                if (flush_out(c) < 0) { close(c->fd); c->fd = -1; nclosed++; continue; }
+                watch(epfd, c, i, c->outlen > 0);
+            }
+
+            if (e & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t n = recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen, 0);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+                if (n <= 0) { close(c->fd); c->fd = -1; nclosed++; continue; }
+                uint64_t t = now_ns();
+                char *p = c->in, *bend = c->in + c->inlen + n;
+                for (;;) {
+                    const char *eol = scan_eol(p, (size_t)(bend - p));
+                    if (!eol) break;
+                    if (handle_line(p, (size_t)(eol - p), t, warm_until)) {
+                        delivered++;
+                        delivered_tick++;
+                        if (t >= warm_until) delivered_measured++;
+                    } else if (eol - p >= 5 && memcmp(p, "PING ", 5) == 0) {
+                        // server 的閒置檢查：回 PONG（輸出 buffer 放不下就算了，下一則訊息一樣證明連線還活著）
+                        size_t tl = (size_t)(eol - p) - 5;
+                        if (c->outlen + tl + 6 <= sizeof(c->out)) {
+                            memcpy(c->out + c->outlen, "PONG ", 5);
+                            memcpy(c->out + c->outlen + 5, p + 5, tl);
+                            c->out[c->outlen + 5 + tl] = '\n';
+                            c->outlen += tl + 6;
+                            if (flush_out(c) < 0) break;
+                            watch(epfd, c, i, c->outlen > 0);
+                        }
+                    } else if (eol > p) {
+                        other++;
+                    }
+                    p = (char *)eol + 1;
+                }
+                c->inlen = (size_t)(bend - p);
+                if (c->inlen == sizeof(c->in)) c->inlen = 0; // 超長的行直接丟掉
+                memmove(c->in, p, c->inlen);
+            }
+        }
+    }
+
+    // ----------- 結果 -----------
+    double secs = (double)duration;
+    printf("\n");
+    printf("connections : %d opened, %d connected, %d closed by server/error\n", nconns, nconnected, nclosed);
+    printf("sent        : %llu msgs (%.0f msg/s), stalled %llu\n",
+           (unsigned long long)sent, (double)sent_measured / secs, (unsigned long long)stalled);
+    printf("delivered   : %llu msgs (%.0f msg/s), other lines %llu\n",
+           (unsigned long long)delivered, (double)delivered_measured / secs, (unsigned long long)other);
+    printf("latency     : p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us  (%llu samples)\n",
+           (double)hist_percentile(0.50) / 1e3, (double)hist_percentile(0.99) / 1e3,
+           (double)hist_percentile(0.999) / 1e3, (double)hist_max / 1e3,
+           (unsigned long long)hist_count);
+
+    for (int i = 0; i < nconns; i++) {
+        if (conns[i].fd >= 0) close(conns[i].fd);
+    }
+    free(conns);
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,91 @@
+// chatframe.h
+// 二進位協定的 frame 格式（server_multi.c 與 client.c 共用）
+//
+// 連線一開始是文字協定。client 送出一行 "PROTO BIN\n"（必須以單一 '\n' 結尾）後，
+// server 回一行文字 "PROTO BIN\n"，從這裡開始雙方都改用 frame，不再以換行分隔：
+//
+//   [u8 type][u8 flags][u16 len][u32 sender] + len bytes 的 payload（整數為 network byte order）
+//
+// 接收端只看標頭就知道訊息種類與長度，不需要掃描內容找行尾或比對指令字串。
+//
+// client -> server（sender 不使用，填 0）：
+//   FRAME_MSG      payload 為要廣播的文字
+//   FRAME_NICK     payload 為新暱稱
+//   FRAME_PRIV     payload 為 "<nick 或 #room> <text>"
+//   FRAME_JOIN / FRAME_PART   payload 為頻道名稱
+//   FRAME_HISTORY  payload 為要重播的則數（十進位文字），空的表示全部
+//   FRAME_PING / FRAME_PONG   payload 為任意 token，收到 PING 要回同樣 token 的 PONG
+// server -> client：
+//   FRAME_MSG      聊天訊息：payload 為 [u8 label 長度][label][text]，sender 為發話者的 id
+//                  （0 表示 server）。label 就是文字協定中 "[...]" 裡的內容，例如暱稱、
+//                  "#room 暱稱"、"寄件者 -> 收件者"；flags 標示頻道或私訊
+//   FRAME_TEXT     server 的回應或通知（錯誤訊息等），payload 為一行文字（不含換行）
+//   FRAME_PING / FRAME_PONG
+//   FRAME_BATCH    payload 為連續的多個完整 frame（重播歷史訊息時使用）
+// payload 一律不可包含 '\n' 或 '\r'（文字協定的 client 也會收到同一則訊息）。
+//
+// client -> server 的 payload 上限為 FRAME_CLIENT_MAX（server 的重組 buffer 放得下整個 frame）。
+// client 應該把較長的訊息切成多個 frame；server 收到更長的 frame 時不會斷線：FRAME_MSG 切成
+// 多則訊息（和文字協定過長的行一樣），其他種類只取前 FRAME_CLIENT_MAX bytes。
+// client 送來的 type 為 0 或帶有 FRAME_F_LZ4 的標頭視為資料錯亂，server 會斷線。
+//
+// 壓縮：以 "PROTO BIN LZ4\n" 協商（server 回覆同一行）時，server 送出的較長 frame 會加上
+// FRAME_F_LZ4，payload 改為 [u16 原本的 payload 長度] + LZ4 block（lz4block.h）。
+// 種類、sender 與其他 flags 不變，解開後就是原本的 frame。只有 server -> client 方向會壓縮。
+
+#ifndef CHATFRAME_H
+#define CHATFRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define FRAME_HDR     8                // 標頭長度
+#define FRAME_MAX_LEN 65535            // payload 長度上限（u16）
+#define FRAME_CLIENT_MAX 2032          // client -> server 的 payload 上限
+
+enum {
+    FRAME_MSG = 1,
+    FRAME_TEXT,
+    FRAME_NICK,
+    FRAME_PRIV,
+    FRAME_JOIN,
+    FRAME_PART,
+    FRAME_HISTORY,
+    FRAME_PING,
+    FRAME_PONG,
+    FRAME_BATCH,
+};
+
+// flags
+#define FRAME_F_ROOM    0x01           // 頻道訊息或頻道通知
+#define FRAME_F_PRIVATE 0x02           // 私訊
+#define FRAME_F_LZ4     0x04           // payload 以 LZ4 壓縮
+
+// 在 p 寫入標頭
+static inline void frame_put(char *p, unsigned type, unsigned flags, size_t len, uint32_t sender) {
+    uint16_t n = htons((uint16_t)len);
+    uint32_t s = htonl(sender);
+    p[0] = (char)type;
+    p[1] = (char)flags;
+    memcpy(p + 2, &n, 2);
+    memcpy(p + 4, &s, 4);
+}
+
+static inline unsigned frame_type(const char *p)  { return (unsigned char)p[0]; }
+static inline unsigned frame_flags(const char *p) { return (unsigned char)p[1]; }
+
+static inline size_t frame_len(const char *p) {
+    uint16_t n;
+    memcpy(&n, p + 2, 2);
+    return ntohs(n);
+}
+
+static inline uint32_t frame_sender(const char *p) {
+    uint32_t s;
+    memcpy(&s, p + 4, 4);
+    return ntohl(s);
+}
+
+#endif // CHATFRAME_H
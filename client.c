@@ -1,20 +1,37 @@
 /* client.c
- * 功能：TCP Chat Client（可自訂暱稱）
+ * 功能：TCP / Unix domain socket Chat Client（可自訂暱稱）
  *
  * 行為：
- *   1) 啟動後先詢問使用者暱稱，連線成功即送出 "NICK <name>"。
+ *   1) 啟動後先詢問使用者暱稱，連線成功即送出 "NICK <name>\n"。
  *   2) 使用 select() 同時監聽 socket（伺服器訊息）和 stdin（鍵盤輸入）。
  *   3) 鍵盤輸入：
  *       - "/quit" -> 主動斷線並結束程式
  *       - "/name 新名" -> 會轉換成 "NICK 新名" 送給 Server，用來更改暱稱
+ *       - "/msg 暱稱 文字" -> 會轉換成 "MSG 暱稱 文字" 送給 Server，私訊給單一使用者
+ *       - "/history [n]" -> 會轉換成 "HISTORY [n]" 送給 Server，重播最近的廣播
+ *       - "/join #room"、"/part #room" -> 會轉換成 "JOIN #room"、"PART #room"，加入、離開頻道
  *       - 其他文字 -> 原樣送出給 Server（Server 會處理換行與格式化）
- *   4) 伺服器傳來的訊息：原樣印出，不自動加換行
+ *   4) 伺服器傳來的訊息：原樣印出，不自動加換行；行尾的 '\r' 會被濾掉（以 linescan.h 掃描）
+ *      server 閒置檢查送來的 "PING <token>" 不印出，自動回覆 "PONG <token>"
+ *   5) -b：連線後送出 "PROTO BIN" 改用二進位協定（chatframe.h）。上面的指令改送對應的 frame，
+ *      一般文字送 FRAME_MSG；收到的 frame 依種類組回 "[label] text" 的格式顯示。
+ *      超過 FRAME_CLIENT_MAX 的訊息與私訊切成多個 frame（不切開 UTF-8 字元），其他指令截斷。
+ *      server 回覆 "PROTO BIN" 之前收到的文字照原樣顯示。
+ *   6) -z：同 -b，但送出 "PROTO BIN LZ4"，要求 server 以 LZ4 壓縮較長的訊息與重播的歷史訊息
+ *      （lz4block.h），收到的壓縮 frame 解開後照常顯示。
+ *   7) 只給一個位址參數時連到 server 的 AF_UNIX listener（server 的 -U）：
+ *      "@name" 為 abstract namespace，其他視為 socket 檔的路徑。
  *
  * 編譯： gcc -O2 -Wall -Wextra -o client client.c
- * 使用： ./client <server-host> <port>
+ * 使用： ./client [-b | -z] <server-host> <port>
+ *        ./client [-b | -z] <unix-path | @name>
  *
  * 範例：
  *   ./client 127.0.0.1 12345
+ *   ./client -b 127.0.0.1 12345
+ *   ./client -z 127.0.0.1 12345
+ *   ./client @chat
+ *   ./client -b /tmp/chat.sock
  */
 
 #include <stdio.h>
@@ -27,44 +44,196 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <sys/select.h>
 
+#include "linescan.h"
+#include "chatframe.h"
+#include "lz4block.h"
+
 #define BUFSIZE 4096   // 緩衝區大小（接收/傳送訊息的暫存空間）
 #define NAMELEN 32     // 暱稱最大長度
 
+// 協定狀態：文字、已送出 PROTO BIN 等待 server 回覆、二進位
+enum { MODE_TEXT, MODE_WAIT, MODE_BIN };
+static int mode = MODE_TEXT;
+
 /* 
  * 功能：移除字串末尾的 '\n' 或 '\r'
  * 用途：處理 fgets() 讀入的輸入字串，避免多餘換行影響訊息格式。
+ *       fgets() 一次只讀一行，所以第一個行尾字元之後都可以截掉。
  */
 static void trim_crlf(char *s) {
-    size_t n = strlen(s);
-    while (n > 0 && (s[n-1] == '\n' || s[n-1] == '\r')) {
-        s[--n] = '\0';
+    const char *eol = scan_eol(s, strlen(s));
+    if (eol) s[eol - s] = '\0';
+}
+
+/*
+ * 功能：顯示 server 傳來的文字資料，回傳處理了幾個 bytes
+ * 以 scan_eol() 逐段找出行尾，'\n' 照印、'\r' 濾掉，其餘內容整段 fwrite，不逐字處理。
+ * server 的 keepalive "PING <token>" 不顯示，直接回 "PONG <token>"。
+ * 等待 PROTO BIN 回覆時，收到回覆就停下來，後面的資料交給 display_frames()。
+ */
+static size_t display(int sockfd, const char *p, size_t n) {
+    static int bol = 1; // 目前位置是否在行首（上一次的資料可能停在行中間）
+    const char *start = p, *end = p + n;
+    while (p < end) {
+        const char *eol = scan_eol(p, (size_t)(end - p));
+        if (!eol) {
+            fwrite(p, 1, (size_t)(end - p), stdout);
+            bol = 0;
+            break;
+        }
+        if (bol && eol - p >= 5 && memcmp(p, "PING ", 5) == 0) {
+            char pong[BUFSIZE];
+            int m = snprintf(pong, sizeof(pong), "PONG %.*s\n", (int)(eol - p - 5), p + 5);
+            send(sockfd, pong, (size_t)m, 0);
+            p = eol + 1;
+            continue;
+        }
+        if (mode == MODE_WAIT && bol && eol - p >= 9 && memcmp(p, "PROTO BIN", 9) == 0) {
+            mode = MODE_BIN;
+            p = eol + 1;
+            break;
+        }
+        bol = 1;
+        fwrite(p, 1, (size_t)(eol - p), stdout);
+        if (*eol == '\n') putchar('\n');
+        p = eol + 1;
     }
+    fflush(stdout);
+    return (size_t)(p - start);
 }
 
-int main(int argc, char *argv[]) {
-    // 驗證參數，必須有 server-host 與 port
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server-host> <port>\n", argv[0]);
-        return 1;
+/*
+ * 功能：從 p[0..len) 取最多 max bytes，不把 UTF-8 字元切成兩半，回傳取的長度
+ */
+static size_t utf8_cut(const char *p, size_t len, size_t max) {
+    if (len <= max) return len;
+    size_t n = max;
+    while (n > 0 && ((unsigned char)p[n] & 0xC0) == 0x80) n--; // p[n] 是字元的後續 byte
+    return n ? n : max;
+}
+
+/*
+ * 功能：送出一個 frame（標頭與 payload 一起送），payload 超過 FRAME_CLIENT_MAX 的部分截掉
+ */
+static ssize_t send_frame(int sockfd, unsigned type, const char *payload, size_t len) {
+    char out[FRAME_HDR + FRAME_CLIENT_MAX];
+    len = utf8_cut(payload, len, FRAME_CLIENT_MAX);
+    frame_put(out, type, 0, len, 0);
+    memcpy(out + FRAME_HDR, payload, len);
+    return send(sockfd, out, FRAME_HDR + len, 0);
+}
+
+/*
+ * 功能：把較長的 payload 切成多個 frame 送出，每個 frame 都以 payload 的前 keep bytes 開頭
+ * （FRAME_PRIV 的 "<nick> "，讓每一段都送給同一個收件者；FRAME_MSG 為 0）
+ */
+static ssize_t send_split(int sockfd, unsigned type, size_t keep, const char *payload, size_t len) {
+    if (keep >= FRAME_CLIENT_MAX / 2) return send_frame(sockfd, type, payload, len);
+    char out[FRAME_HDR + FRAME_CLIENT_MAX];
+    memcpy(out + FRAME_HDR, payload, keep);
+    const char *p = payload + keep, *end = payload + len;
+    do {
+        size_t n = utf8_cut(p, (size_t)(end - p), FRAME_CLIENT_MAX - keep);
+        frame_put(out, type, 0, keep + n, 0);
+        memcpy(out + FRAME_HDR + keep, p, n);
+        if (send(sockfd, out, FRAME_HDR + keep + n, 0) < 0) return -1;
+        p += n;
+    } while (p < end);
+    return (ssize_t)len;
+}
+
+/*
+ * 功能：處理一個完整的 frame
+ * FRAME_MSG 顯示成 "[label] text"，FRAME_TEXT 原樣顯示，FRAME_PING 自動回覆 FRAME_PONG，
+ * FRAME_BATCH 逐一處理裡面的 frame；有 FRAME_F_LZ4 的先解壓縮。
+ */
+static void show_frame(int sockfd, const char *f) {
+    const char *payload = f + FRAME_HDR;
+    size_t len = frame_len(f);
+    if (frame_flags(f) & FRAME_F_LZ4) {
+        static char raw[FRAME_HDR + FRAME_MAX_LEN];
+        if (len < 2) return;
+        uint16_t n;
+        memcpy(&n, payload, 2);            // payload 開頭是原本的長度
+        size_t rawlen = ntohs(n);
+        if (lz4_decompress(payload + 2, len - 2, raw + FRAME_HDR, rawlen) != (long)rawlen) {
+            fprintf(stderr, "bad compressed frame\n");
+            return;
+        }
+        frame_put(raw, frame_type(f), frame_flags(f) & ~FRAME_F_LZ4, rawlen, frame_sender(f));
+        show_frame(sockfd, raw);
+        return;
     }
-    const char *host = argv[1];
-    const char *port = argv[2];
 
-    // 取得使用者輸入的暱稱
-    char myname[NAMELEN];
-    printf("Enter your name: ");
-    fflush(stdout);
-    if (!fgets(myname, sizeof(myname), stdin)) {
-        fprintf(stderr, "no name input\n");
-        return 1;
+    switch (frame_type(f)) {
+    case FRAME_MSG: {
+        size_t label = len > 0 ? (unsigned char)payload[0] : 0;
+        if (label + 1 > len) break;
+        printf("[%.*s] %.*s\n", (int)label, payload + 1, (int)(len - label - 1), payload + label + 1);
+        break;
     }
-    trim_crlf(myname);
-    if (myname[0] == '\0') snprintf(myname, sizeof(myname), "anon"); // 如果沒輸入，給匿名名 anon
+    case FRAME_TEXT:
+        printf("%.*s\n", (int)len, payload);
+        break;
+    case FRAME_PING:
+        send_frame(sockfd, FRAME_PONG, payload, len);
+        break;
+    case FRAME_BATCH:
+        for (const char *p = payload, *end = payload + len;
+             end - p >= FRAME_HDR && (size_t)(end - p) >= FRAME_HDR + frame_len(p);
+             p += FRAME_HDR + frame_len(p)) {
+            if (!(frame_flags(p) & FRAME_F_LZ4)) show_frame(sockfd, p); // 裡面的 frame 不會再壓縮
+        }
+        break;
+    }
+}
 
-    // ----------- 建立 TCP 連線 -----------
+/*
+ * 功能：顯示 server 傳來的 frame
+ * 資料先接到重組 buffer，收齊一個完整的 frame 才交給 show_frame()。
+ */
+static void display_frames(int sockfd, const char *p, size_t n) {
+    static char rx[FRAME_HDR + FRAME_MAX_LEN];
+    static size_t have;
+    while (n > 0) {
+        size_t need = have < FRAME_HDR ? FRAME_HDR : FRAME_HDR + frame_len(rx);
+        size_t take = need - have < n ? need - have : n;
+        memcpy(rx + have, p, take);
+        have += take;
+        p += take;
+        n -= take;
+        if (have < FRAME_HDR || have < FRAME_HDR + frame_len(rx)) continue;
+        show_frame(sockfd, rx);
+        have = 0;
+    }
+    fflush(stdout);
+}
+
+/*
+ * 功能：送出一個指令；文字協定送 "<cmd> <arg>\n"（arg 為空時只送 "<cmd>\n"），
+ *       二進位協定送種類為 type、payload 為 arg 的 frame
+ */
+static void send_cmd(int sockfd, const char *cmd, unsigned type, const char *arg) {
+    if (mode != MODE_TEXT) { // 送出 PROTO BIN 之後 server 就只接受 frame
+        const char *sp = strchr(arg, ' ');
+        if (type == FRAME_PRIV && sp) send_split(sockfd, type, (size_t)(sp + 1 - arg), arg, strlen(arg));
+        else                          send_frame(sockfd, type, arg, strlen(arg));
+        return;
+    }
+    char out[BUFSIZE + 16];
+    int m = snprintf(out, sizeof(out), "%s%s%s\n", cmd, *arg ? " " : "", arg);
+    if (m > (int)sizeof(out) - 1) m = (int)sizeof(out) - 1;
+    send(sockfd, out, (size_t)m, 0);
+}
 
+/*
+ * 功能：以 TCP 連到 host:port，回傳 socket，失敗回傳 -1
+ */
+static int connect_tcp(const char *host, const char *port) {
     struct addrinfo hints, *res, *p;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family   = AF_INET;      // 強制使用 IPv4（可改 AF_UNSPEC 支援 IPv6）
@@ -74,7 +243,7 @@ int main(int argc, char *argv[]) {
     int gai = getaddrinfo(host, port, &hints, &res);
     if (gai != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai));
-        return 1;
+        return -1;
     }
 
     int sockfd = -1;
@@ -88,22 +257,83 @@ int main(int argc, char *argv[]) {
         close(sockfd); sockfd = -1;
     }
     freeaddrinfo(res);
+    return sockfd;
+}
+
+/*
+ * 功能：連到 AF_UNIX socket，path 以 '@' 開頭時為 abstract namespace，回傳 socket，失敗回傳 -1
+ */
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t n = strlen(path);
+    if (n == 0 || n >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: invalid unix socket path\n", path);
+        return -1;
+    }
+    memcpy(addr.sun_path, path, n);
+    if (path[0] == '@') addr.sun_path[0] = '\0'; // abstract namespace：名稱長度由位址長度決定
+    socklen_t alen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + (path[0] != '@'));
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    if (connect(sockfd, (struct sockaddr *)&addr, alen) < 0) {
+        perror(path);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+int main(int argc, char *argv[]) {
+    // 驗證參數：server-host 與 port，或只有一個 AF_UNIX 的路徑；-b 表示使用二進位協定，-z 另外要求壓縮
+    const char *proto = NULL;
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) proto = "PROTO BIN\n";
+    if (argc > 1 && strcmp(argv[1], "-z") == 0) proto = "PROTO BIN LZ4\n";
+    int nargs = argc - 1 - (proto != NULL);
+    if (nargs != 1 && nargs != 2) {
+        fprintf(stderr, "Usage: %s [-b | -z] <server-host> <port>\n"
+                        "       %s [-b | -z] <unix-path | @name>\n", argv[0], argv[0]);
+        return 1;
+    }
+    const char *host = argv[1 + (proto != NULL)];
+    const char *port = nargs == 2 ? argv[2 + (proto != NULL)] : NULL;
 
+    linescan_init(); // 依 CPU 選擇行尾掃描的 SIMD 版本
+
+    // 取得使用者輸入的暱稱
+    char myname[NAMELEN];
+    printf("Enter your name: ");
+    fflush(stdout);
+    if (!fgets(myname, sizeof(myname), stdin)) {
+        fprintf(stderr, "no name input\n");
+        return 1;
+    }
+    trim_crlf(myname);
+    if (myname[0] == '\0') snprintf(myname, sizeof(myname), "anon"); // 如果沒輸入，給匿名名 anon
+
+    // ----------- 建立連線（TCP 或 AF_UNIX） -----------
+
+    int sockfd = port ? connect_tcp(host, port) : connect_unix(host);
     if (sockfd < 0) {
         fprintf(stderr, "Unable to connect\n");
         return 1;
     }
 
-    printf("Connected to %s:%s as '%s'\n", host, port, myname);
+    if (port) printf("Connected to %s:%s as '%s'\n", host, port, myname);
+    else      printf("Connected to %s as '%s'\n", host, myname);
     fflush(stdout);
 
-    // 連線成功後，先告訴 Server 我的暱稱
-    {
-        char nickbuf[BUFSIZE];
-        int n = snprintf(nickbuf, sizeof(nickbuf), "NICK %s", myname);
-        send(sockfd, nickbuf, (size_t)n, 0);
+    // 要求改用二進位協定：server 處理完這一行就開始解讀 frame，所以後面可以直接送 frame
+    if (proto) {
+        send(sockfd, proto, strlen(proto), 0);
+        mode = MODE_WAIT;
     }
 
+    // 連線成功後，先告訴 Server 我的暱稱（文字協定以換行分隔訊息）
+    send_cmd(sockfd, "NICK", FRAME_NICK, myname);
+
     // ----------- 進入主迴圈，使用 select 監聽 socket 與 stdin -----------
 
     fd_set readfds;
@@ -132,10 +362,9 @@ int main(int argc, char *argv[]) {
                 else perror("recv");
                 break;
             }
-            buf[n] = '\0';
-            // 伺服器的訊息已包含換行，因此 client 直接印出即可
-            printf("%s", buf);  // 注意：不額外加 '\n'
-            fflush(stdout);
+            // 伺服器的訊息已包含換行，因此 client 直接印出即可（不額外加 '\n'）
+            size_t used = mode == MODE_BIN ? 0 : display(sockfd, buf, (size_t)n);
+            if (mode == MODE_BIN && used < (size_t)n) display_frames(sockfd, buf + used, (size_t)n - used);
         }
 
         // ----------- Case 2: 使用者鍵盤輸入 -----------
@@ -151,22 +380,45 @@ int main(int argc, char *argv[]) {
                 printf("bye\n");
                 break;
             }
+            trim_crlf(buf);
             if (strncmp(buf, "/name ", 6) == 0) {
                 // 將 "/name 新名" 轉換為 "NICK 新名" 送給 server
                 char *newname = buf + 6;
-                trim_crlf(newname);
                 if (*newname) {
-                    char out[BUFSIZE];
-                    int m = snprintf(out, sizeof(out), "NICK %s", newname);
-                    send(sockfd, out, (size_t)m, 0);
+                    send_cmd(sockfd, "NICK", FRAME_NICK, newname);
                     snprintf(myname, sizeof(myname), "%s", newname); // 本地也更新
                 }
                 continue; // 處理完指令後跳過
             }
+            if (strncmp(buf, "/msg ", 5) == 0) {
+                // 將 "/msg 暱稱 文字" 轉換為 "MSG 暱稱 文字"
+                send_cmd(sockfd, "MSG", FRAME_PRIV, buf + 5);
+                continue;
+            }
+            if (strncmp(buf, "/history", 8) == 0 && (buf[8] == ' ' || buf[8] == '\0')) {
+                // 將 "/history [n]" 轉換為 "HISTORY [n]"
+                send_cmd(sockfd, "HISTORY", FRAME_HISTORY, buf[8] ? buf + 9 : "");
+                continue;
+            }
+            if (strncmp(buf, "/join ", 6) == 0 || strncmp(buf, "/part ", 6) == 0) {
+                // 將 "/join #room"、"/part #room" 轉換為 "JOIN #room"、"PART #room"
+                int join = buf[1] == 'j';
+                send_cmd(sockfd, join ? "JOIN" : "PART", join ? FRAME_JOIN : FRAME_PART, buf + 6);
+                continue;
+            }
 
             // --- 一般聊天訊息 ---
-            // 這裡不移除換行，直接送出，server 收到後會處理換行
-            ssize_t wn = send(sockfd, buf, strlen(buf), 0);
+            // 文字協定補回換行後送出，server 收到後會處理格式化；
+            // 二進位協定送 FRAME_MSG，超過 FRAME_CLIENT_MAX 時切成多個
+            if (buf[0] == '\0') continue;
+            ssize_t wn;
+            if (mode != MODE_TEXT) {
+                wn = send_split(sockfd, FRAME_MSG, 0, buf, strlen(buf));
+            } else {
+                size_t len = strlen(buf);
+                buf[len] = '\n';
+                wn = send(sockfd, buf, len + 1, 0);
+            }
             if (wn < 0) { perror("send"); break; }
         }
     }
@@ -0,0 +1,137 @@
+// lz4block.h
+// 精簡的 LZ4 block 格式壓縮 / 解壓縮（server_multi.c 與 client.c 共用）
+//
+// 輸出是標準的 LZ4 block 格式（沒有 frame 標頭與 checksum），可以用任何 LZ4 實作解開：
+//   每個 sequence 為 [token][literal 長度延伸][literals][u16 LE offset][match 長度延伸]，
+//   token 高 4 bit 是 literal 長度、低 4 bit 是 match 長度 - 4，值為 15 時後面接延伸的 bytes。
+//   最後一個 sequence 只有 literals；最後 5 bytes 一定是 literal，最後一個 match 至少在結尾前 12 bytes 開始。
+//
+// 壓縮採用單一 hash table 的 greedy 比對（和 LZ4 的 fast 模式相同的思路），table 放在 stack，
+// 不需要配置記憶體。聊天訊息只有幾 KiB，table 用 u16 的位置就夠了，所以輸入限制在 64 KiB 以內。
+// 解壓縮會檢查所有長度與 offset，壞掉或惡意的資料只會回傳錯誤，不會讀寫到 buffer 之外。
+
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_HASH_LOG  12               // hash table 4096 格
+#define LZ4_MAX_INPUT 65535            // 位置以 u16 記錄
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5            // 最後 5 bytes 一定是 literal
+#define LZ4_MFLIMIT   12               // match 至少要在結尾前 12 bytes 開始
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// 寫出長度延伸的 bytes（len 已扣掉 token 中的 15）
+static inline uint8_t *lz4_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// 寫出一個 sequence：literals [lit, lit + nlit)，以及 match（mlen 為 0 表示最後一個 sequence）
+// 空間不足回傳 NULL
+static inline uint8_t *lz4_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                                   size_t offset, size_t mlen) {
+    size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (need > (size_t)(oend - op)) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = lz4_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        mlen -= LZ4_MIN_MATCH;
+        *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+        if (mlen >= 15) op = lz4_put_len(op, mlen - 15);
+    }
+    return op;
+}
+
+// 壓縮 src[0..n) 到 dst（容量 cap），回傳壓縮後的長度；放不下（壓縮沒有效果）或 n 太大時回傳 0
+static inline size_t lz4_compress(const char *src, size_t n, char *dst, size_t cap) {
+    if (n > LZ4_MAX_INPUT) return 0;
+    uint16_t table[1 << LZ4_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *base = (const uint8_t *)src, *ip = base, *anchor = base, *end = base + n;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+
+    if (n >= LZ4_MFLIMIT + 1) {
+        const uint8_t *mflimit = end - LZ4_MFLIMIT, *matchlimit = end - LZ4_LAST_LITERALS;
+        while (ip <= mflimit) {
+            uint32_t h = lz4_hash(lz4_read32(ip));
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || lz4_read32(ref) != lz4_read32(ip)) {
+                ip++;
+                continue;
+            }
+            // 往前延伸（吃掉還沒輸出的 literal），再往後延伸到 matchlimit 為止
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) { ip--; ref--; }
+            size_t mlen = LZ4_MIN_MATCH;
+            while (ip + mlen < matchlimit && ip[mlen] == ref[mlen]) mlen++;
+            if (!(op = lz4_put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen)))
+                return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    if (!(op = lz4_put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0))) return 0;
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+// 讀取長度延伸的 bytes，資料不完整回傳 -1
+static inline int lz4_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// 解壓縮 src[0..n) 到 dst（容量 cap），回傳解壓縮後的長度；資料錯誤或放不下回傳 -1
+static inline long lz4_decompress(const char *src, size_t n, char *dst, size_t cap) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + n;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz4_get_len(&ip, iend, &nlit) < 0) return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;         // 最後一個 sequence 沒有 match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz4_get_len(&ip, iend, &mlen) < 0) return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const uint8_t *ref = op - offset;
+        for (size_t k = 0; k < mlen; k++) op[k] = ref[k]; // 可能和輸出重疊，逐 byte 複製
+        op += mlen;
+    }
+    return (long)(op - (uint8_t *)dst);
+}
+
+#endif // LZ4BLOCK_H
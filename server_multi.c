@@ -1,34 +1,505 @@
 // server_multi.c
-// 多人聊天室 Server（使用 select() 同時處理多個 client）
+// 多人聊天室 Server（使用 epoll、io_uring 或 select() 同時處理多個 client）
 //
 // 功能說明：
 //   1. 使用者 (client) 連上 server 後，可以傳送訊息給其他所有 client。
 //   2. server 端輸入的文字會廣播給所有 client，並以 "[server]" 作為前綴，最後加上換行。
 //   3. client 也可以用 "NICK <name>" 設定暱稱，server 廣播時會顯示為 "[name]"。
-//   4. 支援多人連線，最大數量由 MAX_CLIENTS 控制。
+//   4. 支援多人連線，最大數量啟動時以 -n 設定（預設 MAX_CLIENTS），不需要重新編譯。
 //   5. 在 server 端輸入 "/quit" 可以關閉 server。
+//   6. 在 server 端輸入 "/restart"（或送 SIGUSR2）可以換成新版本的執行檔，已連線的 client 不會斷線。
 //
 // 技術重點：
-//   - 使用 select() 同時監聽多個 fd：server socket、標準輸入、以及所有 client socket。
-//   - 使用陣列 clients[] 來管理所有 client socket，names[][] 來存暱稱。
+//   - 事件迴圈有三種 backend，啟動時以 -b 選擇：
+//       epoll  (預設) edge-triggered，每個 fd 只註冊一次，每次喚醒只處理有事件的 socket。
+//       uring  io_uring：multishot accept、multishot recv + provided buffer ring，
+//              廣播的 SENDMSG 在同一個 tick 內累積，一次 io_uring_enter 送出並等待完成事件。
+//       select (備援) 每次迴圈重建 fd_set 並掃描所有 client，fd 上限為 FD_SETSIZE。
+//     uring 或 epoll 無法使用時會依序退回 epoll、select。
+//   - -t N 開啟 N 個 worker thread（shard）。每個 shard 以 SO_REUSEPORT 擁有自己的 listening
+//     socket、事件迴圈與 client 表；廣播時先送給本地 client，再把訊息放進其他 shard 的
+//     inbox（以 eventfd 喚醒），由各 shard 自行送給自己的 client。鍵盤輸入只由 shard 0 處理。
+//   - 使用陣列 clients[] 來管理所有 client socket，names[][] 來存暱稱。這些以 slot 為索引的陣列
+//     一開始只配置 CLIENTS_INIT 格，滿了再倍增；空出來的 slot 放進 free list，accept 時
+//     直接取用，不需要掃描整個表。各陣列只在 client 數量增加時才擴充，上限為 -n 的值，
+//     啟動時也會把 RLIMIT_NOFILE 提高到足以容納這麼多連線。
 //   - 每則訊息會在廣播前加上前綴並且補上 '\n'，確保 client 顯示時換行整齊。
-//   - "NICK " 協定用來讓 client 設定或更改暱稱。
+//     訊息只格式化一次放進參考計數的 msgbuf，廣播給 N 個 client 只是 N 次指標入列。
+//   - 一個 tick（一次事件迴圈喚醒）內產生的輸出先放進各 client 的佇列，tick 結束時每個 client
+//     只用一次 sendmsg（iovec 直接指向共享的 msgbuf，等同 writev）送出全部累積的訊息；
+//     聊天尖峰時 syscall 數量與收件者數量成正比，而不是與「訊息數 x 收件者數」成正比。
+//   - 每個 client 有自己的輸出佇列（上限 -q bytes），socket 一律非阻塞，寫不下的部分等
+//     socket 可寫 (EPOLLOUT / select writefds / io_uring SENDMSG 完成) 再繼續送，慢的 client
+//     不會拖慢其他人。佇列溢位時依 -o 處理：drop-oldest 丟最舊的訊息、disconnect 斷開
+//     該 client、coalesce 把積壓的訊息換成一行「略過 N 則訊息」的通知。
+//   - client 的輸入以 '\n' 或 '\r' 分行（空行略過）：每次 recv 取出所有完整的行逐一處理，
+//     沒收完的半行留在該 client 的重組 buffer 等下一次 recv，所以 TCP 合併或切開的封包
+//     都不影響訊息邊界。超過 BUF_SIZE - 1 的行會被切成多行。行尾以 linescan.h 的
+//     SIMD (AVX2/SSE2) 掃描器尋找。
+//   - "MSG <nick> <text>" 私訊：以暱稱索引找到收件者所在的 shard 與 slot，只送給那一個 client
+//     （其他 shard 的收件者經由該 shard 的 inbox），不會對所有人扇出。
+//   - 頻道："JOIN #room" / "PART #room" 加入、離開，"MSG #room <text>" 只送給該頻道的成員。
+//     每個 shard 各自記錄本地成員：成員是 slot 的緊密陣列，每個 client 記住自己在各頻道陣列中
+//     的位置，離開時與最後一個成員交換即可 O(1) 移除；扇出成本只和頻道人數有關。
+//     server 端輸入 "/rooms" 會列出每個 shard 各頻道的人數、訊息數、扇出次數與 bytes。
+//   - 每個 shard 有自己的 slab 配置器：訊息 buffer、跨 shard 的 xmsg、輸出佇列、io_uring 的 SENDMSG、
+//     重組 buffer 與頻道清單都依大小 (64 ~ 4096 bytes，2 的次方) 從 64 KiB 的 chunk 切出，
+//     釋放後放回 free list 重複使用；別的 shard 釋放的 block 以 lock-free 的 remote list 還給擁有者。
+//     穩定聊天時不會呼叫 malloc/free。server 端輸入 "/slab" 會列出各 shard 的配置統計。
+//   - 每個 shard 在記憶體中保留最近 -H 則廣播（共享 msgbuf 的環狀陣列，只持有參考）。新 client
+//     連線時（送來第一行或 GREET_TICKS 個 tick 之後，讓 PROTO 協商先生效），或送出 "HISTORY [n]" 時，
+//     把這些訊息原封不動放進它的輸出佇列，與其他輸出一起以一次 sendmsg (writev) 送出，
+//     不讀磁碟也不重新格式化。
+//   - -l <dir> 開啟歷史紀錄：每個 shard 把廣播與頻道訊息（不含私訊）附加到自己的 append-only
+//     log。log 分段 (segment，大小 -S bytes)，每段 ftruncate 到固定大小後 mmap，寫入只是 memcpy；
+//     每筆紀錄為 [u32 長度][u64 CLOCK_REALTIME ns][訊息內容（含 "[name] " 前綴與 '\n'）]，
+//     長度 0 表示該段結束。持久化採 group commit：背景 thread 每 -F 毫秒對新寫入的範圍做一次
+//     msync；-F 0 則在每個 tick 送出訊息前先 msync，訊息一定先落地再送給 client。
+//   - client 送出 "PROTO BIN" 後改用二進位協定（chatframe.h）：每個 frame 為
+//     [type][flags][u16 len][u32 sender] + payload，server 依標頭的長度切出 frame、依種類分派，
+//     不需要找行尾或比對指令字串。兩種協定的 client 可以混用：訊息仍以文字格式建立一次，
+//     第一個二進位收件者需要時才轉成 frame 版本，掛在同一個 msgbuf 上讓所有二進位收件者共用。
+//     "PROTO BIN LZ4" 另外要求壓縮：payload 較長的訊息以 LZ4 (lz4block.h) 壓縮，同樣每則只壓縮一次、
+//     所有協商了壓縮的收件者共用壓縮後的 bytes；重播歷史訊息時整批接成一個 frame 一起壓縮。
+//   - "NICK " 協定用來讓 client 設定或更改暱稱。暱稱不分大小寫、不可重複：所有 shard 共用一個
+//     暱稱 -> (shard, slot) 的 hash table（open addressing），以名字找 client 是 O(1)。
+//     "anon<數字>" 保留給尚未設定暱稱的 client（預設名稱 anon<fd>，fd 在 process 內不會重複）。
+//   - -R / -B 限制每個 client 每秒送進來的訊息數與 bytes（各一個 token bucket，額度一秒）。
+//     超過時不丟資料，而是暫停讀取該 client（epoll 拿掉 EPOLLIN、io_uring 取消 recv、select 不監聽），
+//     資料留在 socket buffer 由 TCP 流量控制擋住對方，token 補回後再繼續讀；
+//     洗版的 client 不會佔滿事件迴圈，也不會讓其他人的扇出延遲變長。
+//   - 新連線：listener 為非阻塞，每次喚醒以 accept4(SOCK_NONBLOCK | SOCK_CLOEXEC) 一直接到 EAGAIN
+//     （io_uring 為 multishot accept），backlog 以 -L 設定（預設 LISTEN_BACKLOG），重連風暴時
+//     整批連線一次接上，不會因為 accept 佇列滿了而丟 SYN、讓 client 等好幾秒重送。
+//   - -U <path> 另外開一個 AF_UNIX listener（"@name" 為 abstract namespace，不在檔案系統留下檔案），
+//     給同一台機器上的 client 或 sidecar 使用，省掉 TCP/IP 協定堆疊。它只開在 shard 0
+//     （AF_UNIX 沒有 SO_REUSEPORT 的分流），接上的 client 和 TCP client 共用同一張 client 表、
+//     暱稱、頻道與扇出；熱重啟時一起交給新的 process。
+//   - -M <port> 在 127.0.0.1:<port> 以 Prometheus 文字格式提供統計：連線/斷線數、收送的訊息數與
+//     bytes、sendmsg 次數，以及扇出延遲、輸出佇列深度、事件迴圈處理時間、每次喚醒接受的連線數的
+//     histogram，和各 listener 的 accept 佇列長度。
+//     每個 shard 的計數器只由自己的 thread 寫入（不需要 lock 前綴的原子指令），由獨立的 metrics
+//     thread 讀取加總，熱路徑上沒有任何鎖。
+//   - 半斷線的 client 由計時器偵測：閒置 -I 秒沒有送任何資料，server 送 "PING <token>"，
+//     PONG_TIMEOUT 秒內仍沒有資料就斷線；-N 設定時，連線後必須在期限內送出 NICK。
+//     每個 client 只有一個計時器，放在每個 shard 的階層式 timing wheel（4 層 x 64 格，刻度 100ms），
+//     新增、取消、到期都是 O(1)；收到資料只記錄時間，到期時才決定要不要延後。
+//     select/epoll_wait/io_uring 的等待時間取到下一個非空格子為止，沒有計時器時不會定期醒來。
+//   - 熱重啟：所有 shard 停下後 fork，parent 以同一個 pid exec 新的執行檔，child 經由 AF_UNIX socket
+//     以 SCM_RIGHTS 把 listening socket 與所有 client 的 fd，連同暱稱、協定、頻道、沒處理完的輸入、
+//     還沒送出的輸出與最近的廣播交給它後結束。listener 全程開著，部署時不會讓所有 client 一起重連。
 //   - 如果 client 離線或出錯，server 會清除該連線資源。
+//
+// 使用： ./server [port] [-b epoll|uring|select] [-t threads] [-n max-clients]
+//                 [-L listen-backlog] [-U unix-path|@name] [-q queue-bytes] [-o drop-oldest|disconnect|coalesce]
+//                 [-R msgs-per-sec] [-B bytes-per-sec] [-I idle-seconds] [-N nick-seconds]
+//                 [-H replay-count] [-l log-dir] [-S segment-bytes] [-F fsync-ms]
+//                 [-M metrics-port]
 
+#define _GNU_SOURCE            // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <time.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#include "linescan.h"
+#include "chatframe.h"
+#include "lz4block.h"
 
 #define DEFAULT_PORT   12345   // 預設監聽的 TCP port
-#define MAX_CLIENTS    64      // 可同時接入的最大 client 數
+#define MAX_CLIENTS    64      // 可同時接入的最大 client 數（預設值，可用 -n 調整）
+#define LISTEN_BACKLOG 4096    // listen() 的 backlog（預設值，可用 -L 調整；kernel 會再以 net.core.somaxconn 為上限）
+#define NAME_INDEX_INIT 64     // 暱稱/頻道 hash table 一開始的大小（2 的次方），超過一半滿就倍增
+#define ROOMS_PER_CLIENT 16    // 每個 client 最多同時加入的頻道數
+#define SLAB_CHUNK     (64 * 1024) // slab 每次向系統要的記憶體大小
+#define SLAB_MIN_SHIFT 6       // 最小的 size class 為 64 bytes（放得下 xmsg：NAME_LEN 的名字加指標）
+#define SLAB_CLASSES   7       // 64 ~ 4096 bytes，最大一級放得下 BUF_SIZE 的訊息加前綴
+#define METRIC_BUCKETS 24      // histogram 的 bucket 數（每格上限加倍）
+#define HISTORY_LEN    50      // 新 client 連線時重播的最近廣播數（預設值，可用 -H 調整，0 表示不重播）
+#define HIST_SEGMENT   (64 * 1024 * 1024) // 歷史紀錄每段的預設大小 (bytes)
+#define HIST_SEGMENT_MIN (64 * 1024)     // 每段至少要放得下數十筆最長的訊息
+#define HIST_SYNC_MS   100     // 歷史紀錄 group commit 的預設間隔 (ms)
+#define HIST_HDR       12      // 每筆紀錄的標頭：u32 長度 + u64 時間戳記
+#define TIMER_TICK_MS  100     // timer wheel 的刻度 (ms)
+#define WHEEL_BITS     6       // 每層 64 格
+#define WHEEL_SIZE     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS   4       // 四層涵蓋 6.4 秒、6.8 分、7.3 小時、19 天
+#define IDLE_TIMEOUT   300     // 預設閒置幾秒後送 PING（可用 -I 調整，0 表示不檢查）
+#define PONG_TIMEOUT   30      // 送出 PING 後幾秒內沒有任何回應就斷線
+#define NICK_TIMEOUT   0       // 預設連線後幾秒內必須送出 NICK（可用 -N 調整，0 表示不限制）
+#define GREET_TICKS    2       // 新連線等幾個 tick 再重播歷史訊息（期間送來的 PROTO 會先生效）
+#define FD_RESERVE     32      // client 以外需要的 fd 數（listener、epoll、eventfd、stdout...），每個 shard 另計
+#define CLIENTS_INIT   16      // client 表一開始配置的 slot 數，不夠時倍增
 #define BUF_SIZE       2048    // 訊息緩衝區大小
 #define NAME_LEN       32      // 暱稱的最大長度
+#define FRAME_F_SKIP   0x80    // server 內部：過長 frame 剩下要丟掉的部分（只出現在 feed_frames 改寫的標頭）
+#define COMPRESS_MIN   128     // payload 至少這麼長才嘗試壓縮（更短的聊天訊息幾乎壓不小）
+#define MAX_EVENTS     256     // 每次 epoll_wait 最多取回的事件數
+#define MAX_THREADS    64      // worker thread (shard) 數量上限
+#define OUTQ_LIMIT     (256 * 1024) // 每個 client 輸出佇列的預設上限 (bytes)
+#define URING_ENTRIES  256     // io_uring SQ 大小
+#define URING_CQ_SIZE  4096    // io_uring CQ 大小（廣播時一個 tick 會產生大量 SENDMSG 完成事件）
+#define URING_NBUFS    256     // provided buffer ring 的 buffer 數量（必須是 2 的次方）
+#define URING_BGID     0       // provided buffer group id
+#define SEND_IOV       1024    // 一次 sendmsg / SENDMSG 最多帶幾則佇列中的訊息 (UIO_MAXIOV)
+
+#if FRAME_HDR + FRAME_CLIENT_MAX > BUF_SIZE - 1
+#error "FRAME_CLIENT_MAX 太大：整個 frame（加上結尾的 '\0'）必須放得進重組 buffer"
+#endif
+#define HANDOFF_ENV    "CHAT_HANDOFF_FD" // 熱重啟時告訴新的 process 從哪個 fd 接收狀態
+#define HANDOFF_MAGIC  0x43480001u // 交接資料的開頭（"CH" + 版本），格式不同的版本互相拒絕
+#define HANDOFF_DRAIN_MS 1000  // 熱重啟前最多等多久讓 io_uring 送出中的 SENDMSG 與 recv 結束
+
+// epoll 事件的 data.u32 標記：client 使用 slot 編號，其餘使用保留值
+#define TAG_LISTEN     0xFFFFFFFFu
+#define TAG_STDIN      0xFFFFFFFEu
+#define TAG_INBOX      0xFFFFFFFDu
+#define TAG_UNIX       0xFFFFFFFCu
+
+enum backend { BACKEND_EPOLL, BACKEND_URING, BACKEND_SELECT };
+
+// 輸出佇列溢位時的處理方式
+enum overflow { OVERFLOW_DROP_OLDEST, OVERFLOW_DISCONNECT, OVERFLOW_COALESCE };
+
+// client 使用的協定：文字、二進位 frame、二進位 frame 加上 LZ4 壓縮
+enum { PROTO_TEXT, PROTO_BIN, PROTO_LZ4 };
+
+// slab 配置器：每個 shard 一份，訊息、xmsg、輸出佇列與重組 buffer 都從這裡配置，
+// 穩定聊天時不會呼叫 malloc/free。每塊記憶體前面有 struct slab_hdr 記錄所屬的 cache 與 size class；
+// 由擁有者 thread 釋放時直接放回 free list，由其他 thread 釋放（例如跨 shard 的訊息）時
+// 以 CAS 推進擁有者的 remote list，擁有者 free list 用完時再一次整串收回
+struct slab_hdr {
+    struct slab_cache *owner;          // NULL 表示直接以 malloc 配置（太大或沒有 cache 的 thread）
+    unsigned cls;
+    unsigned pad;                      // 讓資料維持 16 bytes 對齊
+};
+
+struct slab_stats {
+    uint64_t allocs[SLAB_CLASSES];     // 各 size class 的配置次數
+    uint64_t frees, remote_frees;      // 本 thread 釋放的數量，其中屬於其他 cache 的
+    uint64_t refills, chunks;          // 收回 remote list 的次數、向系統要的 chunk 數
+    uint64_t large;                    // 超過最大 size class、改用 malloc 的次數
+};
+
+struct slab_cache {
+    void *free[SLAB_CLASSES];          // 本 thread 的 free list（next 存在 block 的資料區）
+    void *remote[SLAB_CLASSES];        // 其他 thread 還回來的 block，以 __atomic 操作
+    char *chunk;                       // 目前切割中的 chunk
+    size_t chunk_left;
+    void *chunks;                      // 所有 chunk 的串列（開頭存 next），結束時一起釋放
+    struct slab_stats st;
+};
+
+// 統計用的 histogram：第 k 格計算 <= base << k 的值（base 在輸出時決定單位），超過最後一格只算進 count
+struct metric_hist {
+    uint64_t bucket[METRIC_BUCKETS];
+    uint64_t count, sum;
+};
+
+// 每個 shard 的統計；只有擁有者 thread 寫入（METRIC_ADD，不需要 lock 前綴的原子指令），
+// metrics thread 以 relaxed load 讀取，熱路徑上沒有鎖也沒有共享的 cache line
+struct metrics {
+    uint64_t accepts, rejected, disconnects;
+    uint64_t accept_errors;            // EAGAIN 以外的 accept 失敗（例如 EMFILE）
+    uint64_t msgs_in, bytes_in;        // 收到的行數與 bytes
+    uint64_t msgs_out, bytes_out;      // 寫進 socket 的訊息數（每個收件者各算一次）與 bytes
+    uint64_t send_calls;               // sendmsg / SENDMSG 次數
+    uint64_t rate_pauses;              // 因速率限制暫停讀取的次數
+    uint64_t lz4_in, lz4_out;          // 壓縮前後的 payload bytes（每則訊息只壓縮一次）
+    struct metric_hist fanout_ns;      // 訊息建立到交給 kernel 送出的時間（每次送出取最舊的一則）
+    struct metric_hist outq_bytes;     // 每次送出時輸出佇列的深度
+    struct metric_hist loop_ns;        // 每個 tick 醒來到送出完畢的處理時間
+    struct metric_hist accept_batch;   // 每次喚醒接受的連線數
+};
+
+#define METRIC_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+// 共享的訊息 buffer：每則訊息只格式化一次（含 "[name] ...\n" 前綴），之後不再修改，
+// 每個收件者的輸出佇列（包括其他 shard）只持有指標與一個參考計數
+// 二進位協定的 client 收到的是同一則訊息的 frame 版本，第一次需要時才建立，掛在 frame 上共用；
+// 協商了壓縮的 client 收到的壓縮版本同樣只建立一次，掛在 zframe 上
+struct msgbuf {
+    int refs;                          // 以 __atomic 操作，跨 shard 共享也安全
+    int notice;                        // coalesce 產生的「略過 N 則訊息」通知
+    uint64_t born;                     // 建立時所在 tick 的時間 (ns)，用來量扇出延遲；0 表示不計
+    struct msgbuf *frame;              // frame 版本（持有一個參考），以 __atomic 發布
+    struct msgbuf *zframe;             // 壓縮的 frame 版本；壓縮沒有效果時就是 frame 本身
+    uint32_t sender;                   // 發話者的 id（fd），0 表示 server
+    unsigned char type;                // 轉成 frame 時的種類 (FRAME_*)
+    unsigned char flags;               // 轉成 frame 時的 flags (FRAME_F_*)
+    unsigned char label;               // FRAME_MSG："[label] " 前綴中 label 的長度
+    size_t len;
+    char data[];
+};
+
+// 每個 client 的輸出佇列（環狀陣列，容量依需要倍增）
+struct outq {
+    struct msgbuf **ring;
+    unsigned cap, head, count;
+    size_t head_off;                   // 第一則訊息已送出的位元組數
+    size_t bytes;                      // 佇列中尚未送出的位元組數
+    unsigned skipped;                  // coalesce 模式下尚未通知 client 的略過訊息數
+    int blocked;                       // 上次寫入時 socket buffer 已滿，要等可寫才能再送
+};
+
+// io_uring 的 user_data 編碼：低 8 bit 為操作種類，8~31 bit 為 slot，高 32 bit 為 slot 世代
+// SENDMSG 則直接以 struct uring_send 指標當 user_data（slab 以 16 bytes 對齊，低 4 bit 必為 0）
+enum { UOP_ACCEPT = 1, UOP_RECV = 2, UOP_STDIN = 3, UOP_INBOX = 4, UOP_CANCEL = 5, UOP_DRAIN = 6,
+       UOP_ACCEPT_UNIX = 7 };
+
+// 一個送出中的 SENDMSG；訊息已從輸出佇列取出，完成事件回來之前由這個結構持有
+struct uring_send {
+    int slot;
+    uint32_t gen;
+    int nmsg, first;                   // first 為第一個還沒送完的 iovec
+    struct msghdr mh;
+    struct msgbuf **msgs;              // 以下兩個陣列與結構一起配置，長度為 nmsg
+    struct iovec iov[];
+};
+
+// io_uring 的 ring 與每個 client 的送出狀態
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;            // 已填好但尚未發布給 kernel 的 SQE 尾端
+    unsigned sq_submitted;             // 已交給 kernel 的 SQE 尾端
+    int ext_arg;                       // kernel 支援 IORING_ENTER_EXT_ARG（等待可以設定期限）
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_len, sqes_len;
+
+    struct io_uring_buf_ring *br;      // provided buffer ring（multishot recv 用）
+    size_t br_len;
+    char *bufs;                        // URING_NBUFS 個 BUF_SIZE 大小的 buffer
+
+    uint32_t *gen;                     // slot 世代，用來忽略已斷線 client 的過期完成事件
+    unsigned char *inflight;           // 每個 client 同時只有一個 SENDMSG，確保訊息順序
+                                       // 以上兩個陣列與 client 表一起倍增
+};
+
+// 一個 shard 的歷史紀錄 log（目前寫入中的 segment）
+// 寫入只在擁有者 shard 進行；off 以 __atomic 發布給 group commit thread，
+// lock 只在換 segment 與 msync 時使用，寫入本身不需要鎖
+struct histlog {
+    pthread_mutex_t lock;
+    int shard;
+    unsigned seq;                      // 目前 segment 的編號，檔名為 shard<id>-<seq>.log
+    int fd;
+    char *map;                         // 整個 segment 的 mmap
+    size_t size;                       // segment 大小
+    size_t off;                        // 已寫入的位置
+    size_t synced;                     // 已 msync 的位置
+    uint64_t records;                  // 統計：寫入的紀錄數
+};
+
+// xmsg 的種類：slot >= 0 表示給該 slot 上暱稱為 name 的 client 的私訊
+enum { XMSG_BROADCAST = -1, XMSG_ROOM = -2, XMSG_ROOM_STATS = -3, XMSG_SLAB_STATS = -4 };
+
+// 其他 shard 轉送過來的訊息：廣播、頻道訊息（name 為頻道）、私訊（name 為收件者暱稱），
+// 或要求印出頻道 / slab 統計（msg 為 NULL）
+// 私訊轉送途中收件者可能離線、slot 被別人重用，送出前以暱稱再確認一次
+struct xmsg {
+    struct xmsg *next;
+    struct msgbuf *msg;
+    int slot;
+    char name[NAME_LEN];
+};
+
+// 每個 shard 的收件匣：其他 thread 放入訊息後寫 eventfd 喚醒擁有者
+struct inbox {
+    pthread_mutex_t lock;
+    struct xmsg *head, *tail;
+    int efd;
+};
+
+// client 輸入的重組 buffer：存放上次 recv 結尾還沒收到 '\n' 的半行
+// 大部分 recv 都剛好結束在行尾，所以只有真的留下半行時才配置 buf
+struct linebuf {
+    char *buf;                         // BUF_SIZE 大小，需要時才配置
+    size_t len;
+    char *held;                        // 超過速率限制時還沒處理的資料（從行首開始），恢復後再處理
+    size_t held_len, held_cap;
+};
+
+// 每個 client 的計時器狀態；同一時間只有一個計時器（下一個要檢查的期限）
+enum { TIMER_NONE, TIMER_GREET, TIMER_NICK, TIMER_IDLE, TIMER_PING };
+
+// timer wheel 中的一個節點，以 slot 為索引，串列以 slot 編號連結（-1 表示結尾）
+struct timer {
+    int next, prev;
+    int bucket;                        // 所在的格子 (level * WHEEL_SIZE + index)，-1 表示不在 wheel 中
+    unsigned char state;               // TIMER_*
+    uint64_t expire;                   // 到期的 tick
+    uint64_t last_rx;                  // 最後一次收到資料的 tick；收到資料只更新這裡，不動 wheel
+};
+
+// 階層式 timing wheel：level 0 每格一個 tick，level L 每格 64^L 個 tick。
+// 計時器依距離放進對應的層，level 0 轉完一圈時把上一層的下一格重新分配（cascade），
+// 新增、取消與到期都是 O(1)，不需要掃描所有 client
+struct timer_wheel {
+    uint64_t now;                      // 目前的 tick（CLOCK_MONOTONIC / TIMER_TICK_MS）
+    int head[WHEEL_LEVELS][WHEEL_SIZE];// 每格串列的第一個 slot
+    uint64_t used[WHEEL_LEVELS];       // 每層哪些格子不是空的
+    int count;
+};
+
+// 每個 client 的接收速率限制：訊息數與 bytes 各一個 token bucket（單位為 1/1000 個 token）
+// 一次 recv 可能收到超過額度的資料，這時 token 會變成負的，暫停讀取直到補回正數為止
+struct ratelimit {
+    int64_t msgs, bytes;               // 剩下的 token
+    uint64_t last;                     // 上次補充的時間 (ms)
+    int pause_pos;                     // 在 srv->paused[] 的位置，-1 表示沒有暫停
+    int reads_off;                     // 已經停止從 socket 讀取
+    int recv_off;                      // io_uring：暫停後 multishot recv 已經結束，恢復時要重新提交
+};
+
+// 名字索引的一筆資料：暱稱 -> 所在 shard 與 slot；頻道 -> shard 內 rooms[] 的位置（shard 不使用）
+struct name_entry {
+    char name[NAME_LEN];               // 空字串表示空位，比對不分大小寫
+    int shard, idx;
+};
+
+// 名字 -> 位置的 hash table（linear probing，超過一半滿就倍增，刪除時往回搬移，不留墓碑）
+struct name_index {
+    struct name_entry *tab;
+    unsigned cap, count;
+};
+
+static int rate_msgs;                  // -R：每個 client 每秒最多幾則訊息，0 表示不限制
+static int rate_bytes;                 // -B：每個 client 每秒最多幾 bytes，0 表示不限制
+static int idle_timeout = IDLE_TIMEOUT;  // 秒
+static int nick_timeout = NICK_TIMEOUT;  // 秒
+static unsigned history_len = HISTORY_LEN;
+static const char *hist_dir;           // -l：歷史紀錄目錄，NULL 表示不記錄
+static size_t hist_segment = HIST_SEGMENT;
+static int hist_sync_ms = HIST_SYNC_MS;
+
+static int max_clients = MAX_CLIENTS;  // 整個 process（所有 shard 合計）的 client 上限
+static int listen_backlog = LISTEN_BACKLOG;
+static const char *unix_path;          // -U：AF_UNIX listener 的路徑，'@' 開頭為 abstract namespace；NULL 表示不開
+static int nclients;                   // 目前所有 shard 的 client 總數，以 __atomic 操作
+// 頻道：每個 shard 各自一份，只記錄本 shard 的成員；最後一個本地成員離開時釋放
+struct room {
+    char name[NAME_LEN];
+    int idx;                           // 在 srv->rooms[] 的位置
+    int *members;                      // 成員 slot 的緊密陣列
+    int nmembers, cap;
+    uint64_t msgs, deliveries, bytes;  // 統計：頻道訊息數、扇出次數、送出的 bytes
+};
+
+// client 加入的一個頻道，以及自己在該頻道 members[] 中的位置
+struct room_ref {
+    struct room *room;
+    int pos;
+};
+
+// client 加入的所有頻道；refs 在第一次 JOIN 時才配置 ROOMS_PER_CLIENT 格
+struct joined {
+    struct room_ref *refs;
+    int n;
+};
+
+// 一個 shard（worker thread）執行時的狀態
+struct server {
+    int id;                            // shard 編號，0 號同時負責鍵盤輸入
+    pthread_t thread;
+    struct inbox inbox;
+    enum backend backend;
+    int listen_fd;
+    int unix_fd;                       // AF_UNIX listener（-U，只在 shard 0）；沒有時為 -1
+    int epfd;                          // epoll fd；其他模式為 -1
+    struct uring *ring;                // io_uring 狀態；其他模式為 NULL
+    int handoff;                       // 熱重啟交接中：io_uring 不再提交 recv，沒送出的 SENDMSG 放回佇列
+    int accepted;                      // io_uring：這個 tick 的 accept 完成事件數（每條連線一個）
+
+    // client 表：以下以 slot 為索引的陣列長度都是 cap，滿了一起倍增（上限 max_clients）
+    int cap;
+    int nslots;                        // 用過的最大 slot + 1，掃描 client 只需要到這裡
+    int *freelist;                     // 已釋放、可重複使用的 slot（stack，最近釋放的先用）
+    int nfree;
+    int *clients;                      // client socket，0 表示空槽
+    char (*names)[NAME_LEN];           // 每個 slot 的暱稱
+    unsigned char *proto;              // 使用的協定 (PROTO_*)
+    struct outq *outq;                 // 每個 slot 的輸出佇列
+    struct linebuf *inbuf;             // 每個 slot 尚未收完的半行
+    unsigned char *dirty_mark;
+    int *dirty;                        // 這個 tick 有新訊息進入佇列的 slot 清單
+    struct joined *joined;             // 每個 slot 加入的頻道
+    struct timer *timers;              // 每個 slot 的計時器
+    struct ratelimit *rate;            // 每個 slot 的接收速率限制
+    int *paused;                       // 超過速率、暫停讀取中的 slot
+    int ndirty, npaused;
+
+    struct timer_wheel wheel;
+    uint64_t now_ms;                   // 這個 tick 醒來的時間（CLOCK_MONOTONIC ms）
+    struct metrics stats;
+
+    struct slab_cache slab;            // 這個 shard 的 thread 使用的 slab
+    struct histlog *hist;              // 歷史紀錄；沒有 -l 時為 NULL
+    struct msgbuf **recent;            // 最近 history_len 則廣播的環狀陣列（各持有一個參考）
+    struct msgbuf *replay_z;           // 壓縮模式重播全部 recent 的 FRAME_BATCH 快取，NULL 表示沒有
+    unsigned recent_next, nrecent;     // 下一個寫入位置、目前則數
+    struct name_index room_index;      // 頻道名稱 -> rooms[] 位置（只有本 shard 使用，不需要鎖）
+    struct room **rooms;
+    int nrooms, roomcap;
+    char buf[BUF_SIZE];                // 收資料用的暫存區
+};
+
+// 所有 shard；nshards 為 1 時就是原本的單 thread server
+static struct server *shards;
+static int nshards = 1;
+static int stopping;                   // shard 0 收到 /quit 後設定，其他 shard 看到後結束
+static int restarting;                 // /restart 或 SIGUSR2：停下後把連線交給新的 process（在 stopping 之前設定）
+static volatile sig_atomic_t restart_signal; // 收到 SIGUSR2，由 shard 0 的 drain_inbox 處理
+static char self_path[PATH_MAX];      // 熱重啟時 exec 的執行檔（啟動時的路徑，部署換掉的新版本會生效）
+static char **self_argv;
+static int handed_off;                 // 這個 process 是熱重啟 exec 起來、接手了舊 process 的 listener
+
+static size_t outq_limit = OUTQ_LIMIT;
+static enum overflow overflow_policy = OVERFLOW_DROP_OLDEST;
+
+static __thread struct slab_cache *slab_self; // 目前 thread 的 slab，NULL 表示直接用 malloc
+static __thread uint64_t tick_ns;      // 目前 thread 這個 tick 醒來的時間，新訊息以此為建立時間
+static int metrics_port;               // -M：metrics 的 HTTP port（只聽 127.0.0.1），0 表示不開
+
+static struct name_index nicks;        // 所有 shard 共用的暱稱索引，以 nicks_lock 保護
+static pthread_mutex_t nicks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void drop_client(struct server *srv, int i);
+static int flush_client(struct server *srv, int i);
+static struct room *room_find(struct server *srv, const char *name);
+static void room_send_local(struct server *srv, struct room *r, int except_idx, struct msgbuf *m);
+static void room_print_stats(struct server *srv);
+static void feed_client(struct server *srv, int i, char *data, size_t n);
 
 // 去除字串結尾的 CR/LF (\r 或 \n)，避免處理命令或訊息時出現多餘換行
 static void trim_crlf(char *s) {
@@ -38,187 +509,3592 @@ static void trim_crlf(char *s) {
     }
 }
 
-// 廣播訊息給所有 client
-// except_idx 表示排除某個 client（例如訊息來源者不需要收到回送）
-static void broadcast_to_all(int *socks, int except_idx, const char *data, size_t len) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (socks[i] > 0 && i != except_idx) {
-            ssize_t sent = send(socks[i], data, len, 0);
-            (void)sent; // 這裡忽略部分傳送與錯誤處理，簡化版本
-        }
+// 將 fd 設為非阻塞（edge-triggered epoll 需要一次讀到 EAGAIN 為止）
+static int set_nonblocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0) return -1;
+    return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+// ---------------- slab 配置器 ----------------
+
+// 可放 size bytes 的 size class；超過最大一級回傳 SLAB_CLASSES
+static unsigned slab_class(size_t size) {
+    size += sizeof(struct slab_hdr);
+    if (size <= (1u << SLAB_MIN_SHIFT)) return 0;
+    unsigned cls = (unsigned)(64 - __builtin_clzll(size - 1)) - SLAB_MIN_SHIFT;
+    return cls < SLAB_CLASSES ? cls : SLAB_CLASSES;
+}
+
+// 從 chunk 切一塊 class cls 的 block；chunk 剩下的不夠就換一個新的（舊的剩餘部分不再使用）
+static struct slab_hdr *slab_carve(struct slab_cache *c, unsigned cls) {
+    size_t bsize = (size_t)1 << (cls + SLAB_MIN_SHIFT);
+    if (c->chunk_left < bsize) {
+        char *chunk = malloc(SLAB_CHUNK);
+        if (!chunk) return NULL;
+        *(void **)chunk = c->chunks;
+        c->chunks     = chunk;
+        c->chunk      = chunk + 16;
+        c->chunk_left = SLAB_CHUNK - 16;
+        c->st.chunks++;
     }
+    struct slab_hdr *h = (struct slab_hdr *)c->chunk;
+    c->chunk      += bsize;
+    c->chunk_left -= bsize;
+    h->owner = c;
+    h->cls   = cls;
+    return h;
 }
 
-int main(int argc, char **argv) {
-    // 讀取參數指定的 port，若無則使用 DEFAULT_PORT
-    int port = (argc >= 2) ? atoi(argv[1]) : DEFAULT_PORT;
+// 配置 size bytes（16 bytes 對齊）
+static void *slab_alloc(size_t size) {
+    struct slab_cache *c = slab_self;
+    unsigned cls = slab_class(size);
+    struct slab_hdr *h;
+    if (!c || cls == SLAB_CLASSES) {
+        if (c) c->st.large++;
+        if (!(h = malloc(sizeof(*h) + size))) return NULL;
+        h->owner = NULL;
+        return h + 1;
+    }
+    if (!c->free[cls] && __atomic_load_n(&c->remote[cls], __ATOMIC_RELAXED)) {
+        c->free[cls] = __atomic_exchange_n(&c->remote[cls], NULL, __ATOMIC_ACQUIRE);
+        c->st.refills++;
+    }
+    if (c->free[cls]) {
+        void *p = c->free[cls];
+        c->free[cls] = *(void **)p;
+        h = (struct slab_hdr *)p - 1;
+    } else if (!(h = slab_carve(c, cls))) {
+        return NULL;
+    }
+    c->st.allocs[cls]++;
+    return h + 1;
+}
 
-    // 建立 TCP socket
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) { perror("socket"); return 1; }
+static void slab_free(void *p) {
+    if (!p) return;
+    struct slab_hdr *h = (struct slab_hdr *)p - 1;
+    struct slab_cache *c = h->owner, *self = slab_self;
+    if (!c) { free(h); return; }
+    if (self) self->st.frees++;
+    if (c == self) {
+        *(void **)p = c->free[h->cls];
+        c->free[h->cls] = p;
+        return;
+    }
+    // 其他 thread 的 block：推進擁有者的 remote list（擁有者只會整串取走，不會有 ABA 問題）
+    if (self) self->st.remote_frees++;
+    void *head = __atomic_load_n(&c->remote[h->cls], __ATOMIC_RELAXED);
+    do {
+        *(void **)p = head;
+    } while (!__atomic_compare_exchange_n(&c->remote[h->cls], &head, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-    // 設定 SO_REUSEADDR，避免 server 重啟時 bind 失敗
-    int yes = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+// 釋放 cache 的所有 chunk；必須在所有 thread 都不再使用這個 cache 的 block 之後呼叫
+static void slab_destroy(struct slab_cache *c) {
+    while (c->chunks) {
+        void *next = *(void **)c->chunks;
+        free(c->chunks);
+        c->chunks = next;
+    }
+}
 
-    // 設定 server 端地址結構
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family      = AF_INET;           // IPv4
-    addr.sin_addr.s_addr = htonl(INADDR_ANY); // 接收所有網卡
-    addr.sin_port        = htons(port);       // 監聽的 port
+static void slab_print_stats(struct server *srv) {
+    const struct slab_stats *st = &srv->slab.st;
+    uint64_t allocs = 0;
+    for (int k = 0; k < SLAB_CLASSES; k++) allocs += st->allocs[k];
+    printf("shard %d slab: %llu allocs, %llu frees (%llu to other shards), %llu remote refills, "
+           "%llu chunks (%llu KiB), %llu large\n",
+           srv->id, (unsigned long long)allocs, (unsigned long long)st->frees,
+           (unsigned long long)st->remote_frees, (unsigned long long)st->refills, (unsigned long long)st->chunks,
+           (unsigned long long)st->chunks * SLAB_CHUNK / 1024, (unsigned long long)st->large);
+    printf("  by size:");
+    for (int k = 0; k < SLAB_CLASSES; k++)
+        printf(" %d:%llu", 1 << (k + SLAB_MIN_SHIFT), (unsigned long long)st->allocs[k]);
+    printf("\n");
+}
 
-    // 綁定 socket 到指定 port
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(server_fd);
-        return 1;
+// ---------------- 統計 ----------------
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// 記錄一個值：落在 <= base << k 的最小 k 格
+static void metric_observe(struct metric_hist *h, uint64_t v, uint64_t base) {
+    uint64_t q = (v + base - 1) / base;
+    int k = q <= 1 ? 0 : 64 - __builtin_clzll(q - 1);
+    if (k < METRIC_BUCKETS) METRIC_ADD(h->bucket[k], 1);
+    METRIC_ADD(h->count, 1);
+    METRIC_ADD(h->sum, v);
+}
+
+// 送出 client i 的佇列之前：記錄佇列深度與最舊訊息等了多久
+static void metric_send(struct server *srv, struct msgbuf *oldest, size_t queued) {
+    metric_observe(&srv->stats.outq_bytes, queued, 64);
+    if (oldest->born) {
+        uint64_t now = mono_ns();
+        metric_observe(&srv->stats.fanout_ns, now > oldest->born ? now - oldest->born : 0, 1000);
     }
-    // 開始監聽
-    if (listen(server_fd, 16) < 0) {
-        perror("listen");
-        close(server_fd);
-        return 1;
+    METRIC_ADD(srv->stats.send_calls, 1);
+}
+
+// ---------------- 共享訊息 buffer ----------------
+
+// 配置一個可放 cap bytes 的訊息，參考計數為 1（呼叫者持有）
+static struct msgbuf *msg_alloc(size_t cap) {
+    struct msgbuf *m = slab_alloc(sizeof(*m) + cap);
+    if (!m) return NULL;
+    m->refs   = 1;
+    m->notice = 0;
+    m->born   = tick_ns;
+    m->frame  = NULL;
+    m->zframe = NULL;
+    m->sender = 0;
+    m->type   = FRAME_TEXT;
+    m->flags  = 0;
+    m->label  = 0;
+    m->len    = 0;
+    return m;
+}
+
+static struct msgbuf *msg_new(const char *data, size_t len) {
+    struct msgbuf *m = msg_alloc(len);
+    if (!m) return NULL;
+    memcpy(m->data, data, len);
+    m->len = len;
+    return m;
+}
+
+// 組出廣播格式 "[name] text\n"
+static struct msgbuf *msg_line(const char *name, const char *text, size_t textlen) {
+    size_t nlen = strlen(name);
+    struct msgbuf *m = msg_alloc(nlen + textlen + 4);
+    if (!m) return NULL;
+    char *p = m->data;
+    *p++ = '[';
+    memcpy(p, name, nlen);  p += nlen;
+    *p++ = ']';
+    *p++ = ' ';
+    memcpy(p, text, textlen); p += textlen;
+    *p++ = '\n';
+    m->len   = (size_t)(p - m->data);
+    m->type  = FRAME_MSG;
+    m->label = (unsigned char)nlen;
+    return m;
+}
+
+static struct msgbuf *msg_ref(struct msgbuf *m) {
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    return m;
+}
+
+static void msg_unref(struct msgbuf *m) {
+    if (m && __atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        msg_unref(m->frame);
+        msg_unref(m->zframe);
+        slab_free(m);
+    }
+}
+
+// 取得訊息的 frame 版本（二進位協定的收件者用）：從文字版本切出 label 與內容，
+// 每則訊息只轉換一次，之後所有二進位收件者（包括其他 shard）共用同一個 buffer。
+// 兩個 shard 同時轉換時以 CAS 決定留下哪一份。回傳的指標由 m 持有，記憶體不足時回傳 NULL
+static struct msgbuf *msg_frame(struct msgbuf *m) {
+    struct msgbuf *f = __atomic_load_n(&m->frame, __ATOMIC_ACQUIRE);
+    if (f) return f;
+
+    const char *text = m->data;
+    size_t len = m->len;
+    if (len > 0 && text[len - 1] == '\n') len--;
+    size_t label = 0;
+    if (m->type == FRAME_MSG) {         // "[label] text" -> [u8 長度][label][text]
+        label = (size_t)m->label + 1;
+        text += label + 2;
+        len  -= label + 2;
+    } else if (m->type == FRAME_PING) { // "PING token" -> token
+        text += 5;
+        len  -= 5;
+    }
+    if (!(f = msg_alloc(FRAME_HDR + label + len))) return NULL;
+    frame_put(f->data, m->type, m->flags, label + len, m->sender);
+    char *p = f->data + FRAME_HDR;
+    if (label) {
+        *p++ = (char)m->label;
+        memcpy(p, m->data + 1, m->label);
+        p += m->label;
     }
+    memcpy(p, text, len);
+    f->len    = FRAME_HDR + label + len;
+    f->notice = m->notice;
+    f->born   = m->born;
 
-    // 儲存 client socket 與暱稱
-    int clients[MAX_CLIENTS] = {0};
-    char names[MAX_CLIENTS][NAME_LEN];
-    for (int i = 0; i < MAX_CLIENTS; i++) names[i][0] = '\0';
+    struct msgbuf *expected = NULL;
+    if (!__atomic_compare_exchange_n(&m->frame, &expected, f, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        msg_unref(f);
+        f = expected;
+    }
+    return f;
+}
+
+// 把 frame f 的 payload 以 LZ4 壓縮成新的 frame：flags 加上 FRAME_F_LZ4，payload 前面放原本的長度
+// 壓縮後沒有比原本小就回傳 NULL
+static struct msgbuf *frame_compress(struct server *srv, const struct msgbuf *f) {
+    size_t raw = f->len - FRAME_HDR;
+    if (raw <= 3) return NULL;
+    struct msgbuf *z = msg_alloc(f->len);
+    if (!z) return NULL;
+    // 壓縮結果加上 2 bytes 的長度欄位必須比原本短，所以輸出上限是 raw - 3
+    size_t zn = lz4_compress(f->data + FRAME_HDR, raw, z->data + FRAME_HDR + 2, raw - 3);
+    if (zn == 0) {
+        msg_unref(z);
+        return NULL;
+    }
+    frame_put(z->data, frame_type(f->data), frame_flags(f->data) | FRAME_F_LZ4, 2 + zn, frame_sender(f->data));
+    uint16_t rawlen = htons((uint16_t)raw);
+    memcpy(z->data + FRAME_HDR, &rawlen, 2);
+    z->len    = FRAME_HDR + 2 + zn;
+    z->notice = f->notice;
+    z->born   = f->born;
+    METRIC_ADD(srv->stats.lz4_in, raw);
+    METRIC_ADD(srv->stats.lz4_out, 2 + zn);
+    return z;
+}
 
-    printf("Server listening on port %d ... (/quit to stop)\n", port);
+// 取得訊息的壓縮 frame 版本；payload 太短就直接用 frame 版本。
+// 和 msg_frame() 一樣每則訊息只壓縮一次，所有協商了壓縮的收件者共用同一個 buffer
+static struct msgbuf *msg_zframe(struct server *srv, struct msgbuf *m) {
+    struct msgbuf *z = __atomic_load_n(&m->zframe, __ATOMIC_ACQUIRE);
+    if (z) return z;
+    struct msgbuf *f = msg_frame(m);
+    if (!f || f->len - FRAME_HDR < COMPRESS_MIN) return f;
+    if (!(z = frame_compress(srv, f))) z = msg_ref(f);
 
-    fd_set readfds;
-    int maxfd;
-    char buf[BUF_SIZE];
+    struct msgbuf *expected = NULL;
+    if (!__atomic_compare_exchange_n(&m->zframe, &expected, z, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        msg_unref(z);
+        z = expected;
+    }
+    return z;
+}
 
-    for (;;) {
-        // 每次迴圈都要重設 fd_set
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);  // 監聽新連線
-        FD_SET(STDIN_FILENO, &readfds); // 監聽鍵盤輸入
-        maxfd = server_fd;
-
-        // 把所有 client socket 加入監聽集合
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i] > 0) {
-                FD_SET(clients[i], &readfds);
-                if (clients[i] > maxfd) maxfd = clients[i];
+// client i 要收的版本：文字、frame 或壓縮的 frame；記憶體不足時回傳 NULL
+static struct msgbuf *msg_for(struct server *srv, int i, struct msgbuf *m) {
+    switch (srv->proto[i]) {
+    case PROTO_BIN: return msg_frame(m);
+    case PROTO_LZ4: return msg_zframe(srv, m);
+    default:        return m;
+    }
+}
+
+// ---------------- 每個 client 的輸出佇列 ----------------
+
+// 佇列中第 k 則訊息（0 為最舊）
+static struct msgbuf *outq_at(struct outq *q, unsigned k) {
+    return q->ring[(q->head + k) & (q->cap - 1)];
+}
+
+// 確保佇列還放得下一則訊息，滿了就倍增
+static int outq_grow(struct outq *q) {
+    if (q->count < q->cap) return 0;
+    unsigned cap = q->cap ? q->cap * 2 : 8;
+    struct msgbuf **ring = slab_alloc(cap * sizeof(*ring));
+    if (!ring) return -1;
+    for (unsigned k = 0; k < q->count; k++) ring[k] = outq_at(q, k);
+    slab_free(q->ring);
+    q->ring = ring;
+    q->cap  = cap;
+    q->head = 0;
+    return 0;
+}
+
+static int outq_append(struct outq *q, struct msgbuf *m) {
+    if (outq_grow(q) < 0) return -1;
+    q->ring[(q->head + q->count) & (q->cap - 1)] = m;
+    q->count++;
+    q->bytes += m->len;
+    return 0;
+}
+
+// 把訊息放回佇列最前面（熱重啟交接時，io_uring 還沒送出的部分）；第一則必須還沒開始送
+static int outq_unshift(struct outq *q, struct msgbuf *m) {
+    if (outq_grow(q) < 0) return -1;
+    q->head--;
+    q->ring[q->head & (q->cap - 1)] = m;
+    q->count++;
+    q->bytes += m->len;
+    return 0;
+}
+
+// 取出最舊的訊息（不論是否已送出一部分）
+static struct msgbuf *outq_pop(struct outq *q) {
+    if (q->count == 0) return NULL;
+    struct msgbuf *m = outq_at(q, 0);
+    q->bytes   -= m->len - q->head_off;
+    q->head_off = 0;
+    q->head++;
+    q->count--;
+    return m;
+}
+
+// 取出最舊且還沒開始送的訊息；第一則若已送出一部分就不能丟，否則 client 會收到半行
+static struct msgbuf *outq_drop_oldest(struct outq *q) {
+    if (q->head_off == 0) return outq_pop(q);
+    if (q->count < 2) return NULL;
+    unsigned h = q->head & (q->cap - 1), n = (q->head + 1) & (q->cap - 1);
+    struct msgbuf *m = q->ring[n];
+    q->ring[n] = q->ring[h]; // 把送到一半的訊息往後挪一格，頂替被丟掉的位置
+    q->head++;
+    q->count--;
+    q->bytes -= m->len;
+    return m;
+}
+
+static void outq_clear(struct outq *q) {
+    struct msgbuf *m;
+    while ((m = outq_pop(q))) msg_unref(m);
+    slab_free(q->ring);
+    memset(q, 0, sizeof(*q));
+}
+
+// 把訊息（多持有一個參考）放入 client i 的輸出佇列，超過 outq_limit 時依 overflow_policy 處理
+// 回傳 0 表示 client 因為佇列溢位被斷線（或記憶體不足沒有放入）
+static int outq_push(struct server *srv, int i, struct msgbuf *msg) {
+    struct outq *q = &srv->outq[i];
+    size_t len = msg->len;
+    struct msgbuf *m;
+
+    // 佇列要等 tick 結束才寫出，所以超過上限不一定代表 client 太慢：
+    // epoll/select 模式下 socket 還寫得進去就先送出一批；io_uring 模式只有前一批還沒送完時才算積壓
+    if (srv->backend != BACKEND_URING && !q->blocked && q->bytes + len > outq_limit) {
+        if (flush_client(srv, i) < 0) return 0;
+    }
+    int backlogged = srv->backend == BACKEND_URING ? srv->ring->inflight[i] : q->blocked;
+    if (backlogged && q->count > 0 && q->bytes + len > outq_limit) {
+        if (overflow_policy == OVERFLOW_DISCONNECT) {
+            printf("Client %s (fd=%d) too slow, disconnecting.\n", srv->names[i], srv->clients[i]);
+            drop_client(srv, i);
+            return 0;
+        }
+        if (overflow_policy == OVERFLOW_DROP_OLDEST) {
+            while (q->bytes + len > outq_limit && (m = outq_drop_oldest(q))) msg_unref(m);
+        } else {
+            // coalesce：積壓的訊息全部換成一則通知，之前的通知也併入新的計數
+            while ((m = outq_drop_oldest(q))) {
+                if (!m->notice) q->skipped++;
+                msg_unref(m);
+            }
+            char note[64];
+            int n = snprintf(note, sizeof(note), "[server] (%u messages skipped)\n", q->skipped);
+            if ((m = msg_new(note, (size_t)n))) {
+                m->notice = 1;
+                struct msgbuf *out = msg_for(srv, i, m);
+                if (out && outq_append(q, msg_ref(out)) < 0) msg_unref(out);
+                msg_unref(m);
             }
         }
+    }
 
-        // 使用 select 等待事件（新連線 / 有資料可讀）
-        int nready = select(maxfd + 1, &readfds, NULL, NULL, NULL);
-        if (nready < 0) {
-            if (errno == EINTR) continue; // 如果被 signal 中斷則重試
-            perror("select");
-            break;
+    if (outq_append(q, msg_ref(msg)) < 0) { msg_unref(msg); return 0; }
+    return 1;
+}
+
+// 把 client i 的輸出佇列盡量寫進 socket（非阻塞）；寫不下就等 socket 可寫時再呼叫
+// 佇列中的訊息以 iovec 直接指向共享的 msgbuf，一次 sendmsg（等同 writev，但可帶 MSG_NOSIGNAL）
+// 最多送出 SEND_IOV 則，不需要先複製到連續的 buffer
+// 回傳 -1 表示寫入錯誤，client 已被移除
+static int flush_client(struct server *srv, int i) {
+    struct outq *q = &srv->outq[i];
+    struct iovec iov[SEND_IOV];
+    while (q->count > 0) {
+        unsigned n = q->count < SEND_IOV ? q->count : SEND_IOV;
+        size_t total = 0;
+        for (unsigned k = 0; k < n; k++) {
+            struct msgbuf *m = outq_at(q, k);
+            iov[k].iov_base = m->data;
+            iov[k].iov_len  = m->len;
+            total += m->len;
         }
+        iov[0].iov_base = (char *)iov[0].iov_base + q->head_off;
+        iov[0].iov_len -= q->head_off;
+        total -= q->head_off;
 
-        // --- 1. 處理新 client 連線 ---
-        if (FD_ISSET(server_fd, &readfds)) {
-            struct sockaddr_in caddr;
-            socklen_t clen = sizeof(caddr);
-            int cfd = accept(server_fd, (struct sockaddr*)&caddr, &clen);
-            if (cfd < 0) { perror("accept"); continue; }
-
-            // 找一個空槽存放新的 client
-            int slot = -1;
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i] == 0) { slot = i; break; }
-            }
-            if (slot < 0) {
-                // 已達最大人數，拒絕連線
-                const char *msg = "Server full.\n";
-                send(cfd, msg, strlen(msg), 0);
-                close(cfd);
-            } else {
-                // 接受新連線，預設名稱 anon<fd>
-                clients[slot] = cfd;
-                snprintf(names[slot], NAME_LEN, "anon%d", cfd);
-                printf("New client fd=%d at slot=%d name=%s\n", cfd, slot, names[slot]);
-            }
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov    = iov;
+        mh.msg_iovlen = n;
+        metric_send(srv, outq_at(q, 0), q->bytes);
+        ssize_t sent = sendmsg(srv->clients[i], &mh, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { q->blocked = 1; return 0; }
+            drop_client(srv, i);
+            return -1;
         }
 
-        // --- 2. 處理 server 端輸入 ---
-        if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            if (!fgets(buf, sizeof(buf), stdin)) {
-                // EOF（例如 Ctrl+D），直接關閉 server
-                printf("stdin EOF. shutting down.\n");
+        // 依送出的位元組數移動佇列：整則送完的釋放，最後一則可能只送出一部分
+        size_t left = (size_t)sent;
+        METRIC_ADD(srv->stats.bytes_out, left);
+        while (left > 0) {
+            struct msgbuf *m = outq_at(q, 0);
+            if (m->notice) q->skipped = 0; // 通知開始送出，計數歸零
+            size_t rest = m->len - q->head_off;
+            if (left < rest) {
+                q->head_off += left;
+                q->bytes    -= left;
                 break;
             }
-            trim_crlf(buf);
-            if (strcmp(buf, "/quit") == 0) break; // "/quit" 指令關閉 server
+            left -= rest;
+            msg_unref(outq_pop(q));
+            METRIC_ADD(srv->stats.msgs_out, 1);
+        }
+        if ((size_t)sent < total) { q->blocked = 1; return 0; } // socket buffer 已滿
+    }
+    q->blocked = 0;
+    return 0;
+}
+
+// ---------------- 歷史紀錄 log ----------------
+
+// 找出 dir 中 shard 已有的最大 segment 編號，新的 segment 從下一號開始
+static unsigned hist_next_seq(int shard) {
+    unsigned next = 0;
+    DIR *d = opendir(hist_dir);
+    if (!d) return 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        int sh;
+        unsigned seq;
+        if (sscanf(de->d_name, "shard%d-%u.log", &sh, &seq) == 2 && sh == shard && seq >= next) next = seq + 1;
+    }
+    closedir(d);
+    return next;
+}
+
+// 開一個新的 segment：建立檔案、ftruncate 到 segment 大小、mmap；失敗回傳 -1
+static int hist_open_segment(struct histlog *h) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/shard%d-%08u.log", hist_dir, h->shard, h->seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) { perror(path); return -1; }
+    if (ftruncate(fd, (off_t)h->size) < 0) { perror("ftruncate"); close(fd); return -1; }
+    char *map = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { perror("mmap"); close(fd); return -1; }
+    h->fd     = fd;
+    h->map    = map;
+    h->synced = 0;
+    __atomic_store_n(&h->off, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// 把 [synced, off) msync 到磁碟；呼叫者需持有 h->lock
+static void hist_sync_locked(struct histlog *h) {
+    size_t off = __atomic_load_n(&h->off, __ATOMIC_ACQUIRE);
+    if (!h->map || off == h->synced) return;
+    size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = h->synced & ~(page - 1); // msync 的起點必須對齊 page
+    if (msync(h->map + start, off - start, MS_SYNC) < 0) perror("msync");
+    h->synced = off;
+}
+
+// 結束目前的 segment：同步、把檔案截到實際寫入的長度
+static void hist_close_segment(struct histlog *h) {
+    if (!h->map) return;
+    hist_sync_locked(h);
+    munmap(h->map, h->size);
+    if (ftruncate(h->fd, (off_t)h->off) < 0) perror("ftruncate");
+    if (fsync(h->fd) < 0) perror("fsync");
+    close(h->fd);
+    h->map = NULL;
+    h->fd  = -1;
+}
+
+static struct histlog *hist_open(int shard) {
+    struct histlog *h = calloc(1, sizeof(*h));
+    if (!h) return NULL;
+    pthread_mutex_init(&h->lock, NULL);
+    h->shard = shard;
+    h->size  = hist_segment;
+    h->fd    = -1;
+    h->seq   = hist_next_seq(shard);
+    if (hist_open_segment(h) < 0) {
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+static void hist_close(struct histlog *h) {
+    if (!h) return;
+    pthread_mutex_lock(&h->lock);
+    hist_close_segment(h);
+    pthread_mutex_unlock(&h->lock);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+// 附加一筆紀錄：只是 memcpy 進 mmap 的 segment，不呼叫 write()；放不下時換下一個 segment
+static void hist_append(struct histlog *h, const struct msgbuf *m) {
+    if (!h || !h->map) return;
+    size_t need = HIST_HDR + m->len;
+    size_t off  = h->off;
+    if (off + need + 4 > h->size) { // 保留 4 bytes 給結尾的長度 0
+        pthread_mutex_lock(&h->lock);
+        hist_close_segment(h);
+        h->seq++;
+        int rc = hist_open_segment(h);
+        pthread_mutex_unlock(&h->lock);
+        if (rc < 0) return;
+        off = 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint32_t len = (uint32_t)m->len;
+    uint64_t ns  = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    memcpy(h->map + off, &len, 4);
+    memcpy(h->map + off + 4, &ns, 8);
+    memcpy(h->map + off + HIST_HDR, m->data, m->len);
+    h->records++;
+    __atomic_store_n(&h->off, off + need, __ATOMIC_RELEASE);
+}
+
+static void hist_sync(struct histlog *h) {
+    if (!h) return;
+    pthread_mutex_lock(&h->lock);
+    hist_sync_locked(h);
+    pthread_mutex_unlock(&h->lock);
+}
+
+// group commit thread：每 hist_sync_ms 把所有 shard 新寫入的紀錄一起 msync
+static void *hist_sync_main(void *arg) {
+    (void)arg;
+    struct timespec iv = { hist_sync_ms / 1000, (long)(hist_sync_ms % 1000) * 1000000L };
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&iv, NULL);
+        for (int k = 0; k < nshards; k++) hist_sync(shards[k].hist);
+    }
+    return NULL;
+}
+
+// ---------------- metrics（Prometheus 文字格式） ----------------
+
+#define METRIC_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
 
-            // 廣播訊息，格式為 [server] <msg>\n
-            char out[BUF_SIZE + 16];
-            int m = snprintf(out, sizeof(out), "[server] %s\n", buf);
-            if (m < 0) m = 0;
-            broadcast_to_all(clients, -1, out, (size_t)m);
+// 輸出每個 shard 的一個 counter
+static void metrics_counter(FILE *f, const char *name, const char *help, size_t off) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int k = 0; k < nshards; k++) {
+        const uint64_t *v = (const uint64_t *)((const char *)&shards[k].stats + off);
+        fprintf(f, "%s{shard=\"%d\"} %llu\n", name, k, (unsigned long long)METRIC_LOAD(*v));
+    }
+}
+
+// 輸出每個 shard 的一個 histogram；bucket 上限為 base << k，再乘上 scale 換成輸出的單位
+// 各格是分別讀取的，+Inf 與 _count 以讀到的各格加總為準，保持一致
+static void metrics_histogram(FILE *f, const char *name, const char *help, size_t off,
+                              uint64_t base, double scale) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int k = 0; k < nshards; k++) {
+        const struct metric_hist *h = (const struct metric_hist *)((const char *)&shards[k].stats + off);
+        uint64_t cum = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            cum += METRIC_LOAD(h->bucket[b]);
+            fprintf(f, "%s_bucket{shard=\"%d\",le=\"%.10g\"} %llu\n", name, k,
+                    (double)(base << b) * scale, (unsigned long long)cum);
         }
+        uint64_t count = METRIC_LOAD(h->count);
+        if (count < cum) count = cum;
+        fprintf(f, "%s_bucket{shard=\"%d\",le=\"+Inf\"} %llu\n", name, k, (unsigned long long)count);
+        fprintf(f, "%s_sum{shard=\"%d\"} %.17g\n", name, k, (double)METRIC_LOAD(h->sum) * scale);
+        fprintf(f, "%s_count{shard=\"%d\"} %llu\n", name, k, (unsigned long long)count);
+    }
+}
 
-        // --- 3. 處理 client 傳來的資料 ---
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            int sd = clients[i];
-            if (sd <= 0) continue;
-            if (!FD_ISSET(sd, &readfds)) continue;
+// 各 shard listener 的 accept 佇列：TCP_INFO 對 listening socket 回報目前排隊的連線數 (tcpi_unacked)
+// 與 backlog 上限 (tcpi_sacked)。佇列接近上限時 kernel 開始丟 SYN，client 要等重送才連得上
+static void metrics_accept_queue(FILE *f) {
+    static const char *const names[2] = { "chat_accept_queue", "chat_accept_queue_limit" };
+    static const char *const helps[2] = { "Connections waiting in the listen queue.",
+                                          "Listen queue capacity (backlog after the somaxconn cap)." };
+    for (int g = 0; g < 2; g++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n", names[g], helps[g], names[g]);
+        for (int k = 0; k < nshards; k++) {
+            struct tcp_info ti;
+            socklen_t len = sizeof(ti);
+            if (getsockopt(shards[k].listen_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) continue;
+            fprintf(f, "%s{shard=\"%d\"} %u\n", names[g], k, g ? ti.tcpi_sacked : ti.tcpi_unacked);
+        }
+    }
+}
 
-            // 收資料
-            int n = recv(sd, buf, sizeof(buf) - 1, 0);
-            if (n <= 0) {
-                // client 離線或錯誤
-                printf("Client %s (fd=%d) disconnected.\n", names[i], sd);
-                close(sd);
-                clients[i] = 0;
-                names[i][0] = '\0';
-                continue;
-            }
-            buf[n] = '\0';
-            trim_crlf(buf); // 移除換行
-
-            // 協定：NICK <name> -> 設定暱稱
-            if (strncmp(buf, "NICK ", 5) == 0) {
-                const char *newname = buf + 5;
-                if (*newname == '\0') {
-                    const char *msg = "Name cannot be empty";
-                    send(sd, msg, strlen(msg), 0);
-                    continue;
-                }
-                char clean[NAME_LEN];
-                int k = 0;
-                // 過濾掉非印字元與 '['、']'
-                for (; *newname && k < NAME_LEN - 1; newname++) {
-                    if (isprint((unsigned char)*newname) && *newname != '[' && *newname != ']') {
-                        clean[k++] = *newname;
-                    }
-                }
-                clean[k] = '\0';
-                if (k == 0) {
-                    const char *msg = "Invalid name";
-                    send(sd, msg, strlen(msg), 0);
-                    continue;
-                }
-                printf("Client fd=%d set name: %s -> %s\n", sd, names[i], clean);
-                snprintf(names[i], NAME_LEN, "%s", clean);
-                continue; // 改名不廣播
-            }
+// 組出整份 metrics；只讀取各 shard 的計數器，不和 shard 搶任何鎖
+static char *metrics_render(size_t *len) {
+    char *body = NULL;
+    FILE *f = open_memstream(&body, len);
+    if (!f) return NULL;
+    fprintf(f, "# HELP chat_clients Connected clients.\n# TYPE chat_clients gauge\nchat_clients %d\n",
+            __atomic_load_n(&nclients, __ATOMIC_RELAXED));
+    metrics_counter(f, "chat_accepts_total", "Accepted connections.", offsetof(struct metrics, accepts));
+    metrics_counter(f, "chat_rejected_total", "Connections refused because the server was full.",
+                    offsetof(struct metrics, rejected));
+    metrics_counter(f, "chat_accept_errors_total", "accept failures other than an empty queue (e.g. EMFILE).",
+                    offsetof(struct metrics, accept_errors));
+    metrics_accept_queue(f);
+    metrics_counter(f, "chat_disconnects_total", "Closed client connections.", offsetof(struct metrics, disconnects));
+    metrics_counter(f, "chat_messages_in_total", "Lines received from clients.", offsetof(struct metrics, msgs_in));
+    metrics_counter(f, "chat_bytes_in_total", "Bytes received from clients.", offsetof(struct metrics, bytes_in));
+    metrics_counter(f, "chat_messages_out_total", "Messages written to client sockets (per recipient).",
+                    offsetof(struct metrics, msgs_out));
+    metrics_counter(f, "chat_bytes_out_total", "Bytes written to client sockets.", offsetof(struct metrics, bytes_out));
+    metrics_counter(f, "chat_send_calls_total", "sendmsg calls or io_uring SENDMSG submissions.",
+                    offsetof(struct metrics, send_calls));
+    metrics_counter(f, "chat_rate_limited_total", "Times a client's reads were paused by the rate limit.",
+                    offsetof(struct metrics, rate_pauses));
+    metrics_counter(f, "chat_lz4_input_bytes_total", "Frame payload bytes compressed (once per message).",
+                    offsetof(struct metrics, lz4_in));
+    metrics_counter(f, "chat_lz4_output_bytes_total", "Compressed frame payload bytes produced.",
+                    offsetof(struct metrics, lz4_out));
+    metrics_histogram(f, "chat_fanout_latency_seconds", "Age of the oldest queued message when its send starts.",
+                      offsetof(struct metrics, fanout_ns), 1000, 1e-9);
+    metrics_histogram(f, "chat_outq_bytes", "Output queue depth when a send starts.",
+                      offsetof(struct metrics, outq_bytes), 64, 1);
+    metrics_histogram(f, "chat_loop_seconds", "Event loop processing time per wakeup.",
+                      offsetof(struct metrics, loop_ns), 1000, 1e-9);
+    metrics_histogram(f, "chat_accept_batch_size", "Connections accepted per event loop wakeup.",
+                      offsetof(struct metrics, accept_batch), 1, 1);
+    fclose(f);
+    return body;
+}
+
+// metrics thread：一次處理一個 HTTP 連線，不管要求的路徑都回傳整份 metrics
+// 每 200ms 醒來檢查一次 server 是否正在關閉
+static void *metrics_main(void *arg) {
+    int lfd = *(int *)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { lfd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) continue;
+        struct timeval tv = { 1, 0 };
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        ssize_t r = recv(cfd, req, sizeof(req), 0); // 只讀第一段要求，內容不看
+        (void)r;
+        size_t len = 0;
+        char *body = metrics_render(&len);
+        if (body) {
+            char hdr[128];
+            int n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                               "Content-Length: %zu\r\n\r\n", len);
+            struct iovec iov[2] = { { hdr, (size_t)n }, { body, len } };
+            struct msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_iov    = iov;
+            mh.msg_iovlen = 2;
+            ssize_t w = sendmsg(cfd, &mh, MSG_NOSIGNAL);
+            (void)w;
+            free(body);
+        }
+        close(cfd);
+    }
+    return NULL;
+}
+
+// 建立 metrics 的 listening socket（只聽 127.0.0.1），失敗回傳 -1
+static int metrics_listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("metrics");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// ---------------- io_uring 基本操作（直接使用 syscall，不依賴 liburing） ----------------
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 把目前填好的 SQE 交給 kernel，wait_nr > 0 時順便等待至少 wait_nr 個完成事件
+// timeout_ms >= 0 時最多等這麼久（需要 IORING_FEAT_EXT_ARG，否則一直等到有完成事件）
+static int uring_submit(struct uring *r, unsigned wait_nr, int timeout_ms) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = r->sq_local_tail - r->sq_submitted;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr && timeout_ms >= 0 && r->ext_arg) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp   = &arg;
+        argsz  = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    for (;;) {
+        int ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags, argp, argsz);
+        if (ret < 0 && errno == ETIME) return 0; // 等到了計時器的期限
+        if (ret < 0 && errno == EINTR) {
+            if (wait_nr) return 0; // 被 signal 中斷，回到迴圈重新處理
+            continue;
+        }
+        // CQ 積壓 (EBUSY/EAGAIN) 時先回去處理完成事件
+        if (ret < 0 && (errno == EBUSY || errno == EAGAIN)) return 0;
+        if (ret < 0) return -1;
+        r->sq_submitted += (unsigned)ret;
+        return 0;
+    }
+}
+
+// 取得一個空的 SQE；SQ 滿了就先送出目前累積的 SQE
+static struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        if (uring_submit(r, 0, -1) < 0) return NULL;
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+    r->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// 把用完的 provided buffer 還給 kernel
+static void uring_recycle_buf(struct uring *r, unsigned bid) {
+    unsigned short tail = r->br->tail;
+    struct io_uring_buf *b = &r->br->bufs[tail & (URING_NBUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * BUF_SIZE);
+    b->len  = BUF_SIZE - 1;            // 保留一個 byte 放 '\0'
+    b->bid  = (unsigned short)bid;
+    __atomic_store_n(&r->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static uint64_t uring_slot_data(struct uring *r, int op, int slot) {
+    return (uint64_t)op | ((uint64_t)slot << 8) | ((uint64_t)r->gen[slot] << 32);
+}
+
+// multishot accept：一個 SQE 會持續產生新連線的完成事件
+// op 為 UOP_ACCEPT（TCP listener）或 UOP_ACCEPT_UNIX（AF_UNIX listener）
+static void uring_prep_accept(struct server *srv, int op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(srv->ring);
+    if (!sqe) return;
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = op == UOP_ACCEPT_UNIX ? srv->unix_fd : srv->listen_fd;
+    sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)op;
+}
+
+// multishot recv：資料放進 provided buffer ring，直到 EOF、錯誤或 buffer 用盡才結束
+static void uring_prep_recv(struct server *srv, int slot) {
+    if (srv->handoff) return;          // 交接中：資料留在 socket 給新的 process
+    struct io_uring_sqe *sqe = uring_get_sqe(srv->ring);
+    if (!sqe) return;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = srv->clients[slot];
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_slot_data(srv->ring, UOP_RECV, slot);
+}
+
+// stdin 與 inbox eventfd 用一次性的 POLL_ADD，可讀後再交給 fgets()/read()
+static void uring_prep_poll(struct server *srv, int fd, int op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(srv->ring);
+    if (!sqe) return;
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = (uint64_t)op;
+}
+
+static void uring_send_free(struct uring_send *op) {
+    for (int k = 0; k < op->nmsg; k++) msg_unref(op->msgs[k]);
+    slab_free(op);
+}
+
+// 取不到 SQE 時回傳 -1，op 仍歸呼叫者處理
+static int uring_prep_send(struct server *srv, struct uring_send *op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(srv->ring);
+    if (!sqe) return -1;
+    memset(&op->mh, 0, sizeof(op->mh));
+    op->mh.msg_iov    = &op->iov[op->first];
+    op->mh.msg_iovlen = (size_t)(op->nmsg - op->first);
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = srv->clients[op->slot];
+    sqe->addr      = (uint64_t)(uintptr_t)&op->mh;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    return 0;
+}
+
+static void uring_send_requeue(struct server *srv, struct uring_send *op);
+
+// 每個 tick 結束前：替這個 tick 有新訊息的 client 各準備一個 SENDMSG，帶上佇列中的訊息
+// （最多 SEND_IOV 則），之後與其他 SQE 一起交給 kernel
+// 每個 client 同時只有一個 SENDMSG，完成後再送下一批。
+// 配置不到 op 或取不到 SQE 的 client 留在 dirty list（訊息仍在佇列），下一個 tick 再試
+static void uring_flush_sends(struct server *srv) {
+    struct uring *r = srv->ring;
+    int kept = 0;
+    for (int k = 0; k < srv->ndirty; k++) {
+        int i = srv->dirty[k];
+        struct outq *q = &srv->outq[i];
+        if (srv->clients[i] == 0 || r->inflight[i] || q->count == 0) {
+            srv->dirty_mark[i] = 0;
+            continue;
+        }
+
+        unsigned n = q->count < SEND_IOV ? q->count : SEND_IOV;
+        struct uring_send *op = slab_alloc(sizeof(*op) + n * (sizeof(struct iovec) + sizeof(struct msgbuf *)));
+        if (!op) {
+            srv->dirty[kept++] = i;
+            continue;
+        }
+        struct msgbuf *head = outq_at(q, 0);
+        size_t bytes = q->bytes;
+        op->slot  = i;
+        op->gen   = r->gen[i];
+        op->first = 0;
+        op->nmsg  = 0;
+        op->msgs  = (struct msgbuf **)&op->iov[n];
+        while ((unsigned)op->nmsg < n) {
+            size_t off = q->head_off;  // 第一則可能已送出一部分
+            struct msgbuf *m = outq_pop(q);
+            if (m->notice) q->skipped = 0;
+            op->msgs[op->nmsg] = m;
+            op->iov[op->nmsg].iov_base = m->data + off;
+            op->iov[op->nmsg].iov_len  = m->len - off;
+            op->nmsg++;
+        }
+        if (uring_prep_send(srv, op) < 0) {
+            uring_send_requeue(srv, op);
+            uring_send_free(op);
+            srv->dirty[kept++] = i;
+            continue;
+        }
+        r->inflight[i] = 1;
+        srv->dirty_mark[i] = 0;
+        metric_send(srv, head, bytes);
+    }
+    srv->ndirty = kept;
+}
 
-            // 一般訊息：印在 server 終端，並廣播給其他 client
-            printf("[%s] %s\n", names[i], buf);
+// 記錄 client i 這個 tick 有新訊息，tick 結束時才一起送出
+static void mark_dirty(struct server *srv, int i) {
+    if (srv->dirty_mark[i]) return;
+    srv->dirty_mark[i] = 1;
+    srv->dirty[srv->ndirty++] = i;
+}
 
-            char out[BUF_SIZE + NAME_LEN + 8];
-            int m = snprintf(out, sizeof(out), "[%s] %s\n", names[i], buf); // 廣播格式
-            if (m < 0) m = 0;
-            broadcast_to_all(clients, i, out, (size_t)m);
+// tick 結束：把這個 tick 內累積在各 client 佇列的訊息送出，每個 client 一次 sendmsg
+// （io_uring 模式則是每個 client 一個 SENDMSG SQE）。同一個 tick 內收到多則廣播時，
+// syscall 數量只和收件者數量有關，與訊息數量無關
+static void flush_dirty(struct server *srv) {
+    if (hist_sync_ms == 0) hist_sync(srv->hist); // -F 0：這個 tick 的紀錄先落地再送出
+    if (srv->backend == BACKEND_URING) {
+        uring_flush_sends(srv);
+    } else {
+        for (int k = 0; k < srv->ndirty; k++) {
+            int i = srv->dirty[k];
+            srv->dirty_mark[i] = 0;
+            if (srv->clients[i] > 0 && srv->outq[i].count > 0) flush_client(srv, i);
         }
+        srv->ndirty = 0;
     }
+    // tick 結束：記錄從醒來到送出完畢的處理時間
+    if (tick_ns) metric_observe(&srv->stats.loop_ns, mono_ns() - tick_ns, 1000);
+}
+
+// 把共享訊息放進 client i 的輸出佇列（佇列多持有一個參考，呼叫者的參考不變）
+// 不會立刻寫 socket：等 tick 結束時由 flush_dirty() 批次送出
+// 二進位協定的 client 改送 frame（或壓縮的 frame）版本
+static void send_msg(struct server *srv, int i, struct msgbuf *m) {
+    if (!(m = msg_for(srv, i, m))) return;
+    if (outq_push(srv, i, m)) mark_dirty(srv, i);
+}
+
+// 傳送一段文字給單一 client（例如錯誤訊息）
+static void send_to_client(struct server *srv, int i, const char *data, size_t len) {
+    struct msgbuf *m = msg_new(data, len);
+    if (!m) return;
+    send_msg(srv, i, m);
+    msg_unref(m);
+}
+
+// 記住最近的廣播：每個 shard 都會看到所有廣播（本地的與 inbox 轉來的），各自保留一份，
+// 不需要跨 thread 的鎖；環狀陣列只持有參考，滿了就釋放最舊的一則
+static void recent_add(struct server *srv, struct msgbuf *m) {
+    if (!srv->recent) return;
+    msg_unref(srv->replay_z);          // 重播的內容變了
+    srv->replay_z = NULL;
+    struct msgbuf **slot = &srv->recent[srv->recent_next];
+    msg_unref(*slot);
+    *slot = msg_ref(m);
+    srv->recent_next = (srv->recent_next + 1) % history_len;
+    if (srv->nrecent < history_len) srv->nrecent++;
+}
+
+// 把一個已經是 frame 的訊息直接放進 client i 的佇列（不經過 msg_for 轉換）
+static void send_frame(struct server *srv, int i, struct msgbuf *f) {
+    if (outq_push(srv, i, f)) mark_dirty(srv, i);
+}
+
+// 壓縮模式的重播：從第 k 格開始的 n 則訊息的 frame 接成一個 FRAME_BATCH 再一起壓縮，
+// 短訊息之間重複的暱稱與字詞也能壓掉。重播全部訊息（新連線時的情況）的結果會快取起來，
+// 直到下一則廣播進來。接起來超過 frame 的長度上限或壓不小時回傳 0，改成逐則送出
+static int recent_replay_batch(struct server *srv, int i, unsigned k, unsigned n) {
+    if (n == srv->nrecent && srv->replay_z) {
+        send_frame(srv, i, srv->replay_z);
+        return 1;
+    }
+    size_t total = 0;
+    for (unsigned c = 0, j = k; c < n; c++, j = (j + 1) % history_len) {
+        struct msgbuf *f = msg_frame(srv->recent[j]);
+        if (!f) return 0;
+        total += f->len;
+    }
+    if (total > FRAME_MAX_LEN) return 0;
+    struct msgbuf *b = msg_alloc(FRAME_HDR + total), *z;
+    if (!b) return 0;
+    frame_put(b->data, FRAME_BATCH, 0, total, 0);
+    b->len = FRAME_HDR;
+    for (unsigned c = 0, j = k; c < n; c++, j = (j + 1) % history_len) {
+        struct msgbuf *f = srv->recent[j]->frame;
+        memcpy(b->data + b->len, f->data, f->len);
+        b->len += f->len;
+    }
+    z = frame_compress(srv, b);
+    msg_unref(b);
+    if (!z) return 0;
+    send_frame(srv, i, z);
+    if (n == srv->nrecent) srv->replay_z = msg_ref(z);
+    msg_unref(z);
+    return 1;
+}
+
+// 把最近 n 則廣播依時間順序放進 client i 的佇列：訊息不複製、不重新格式化，
+// tick 結束時和其他訊息一起以一次 sendmsg 送出（history_len 不超過 SEND_IOV）
+static void recent_replay(struct server *srv, int i, unsigned n) {
+    if (n > srv->nrecent) n = srv->nrecent;
+    if (n == 0) return;
+    unsigned k = (srv->recent_next + history_len - n) % history_len;
+    if (srv->proto[i] == PROTO_LZ4 && n > 1 && recent_replay_batch(srv, i, k, n)) return;
+    for (; n > 0; n--, k = (k + 1) % history_len) {
+        send_msg(srv, i, srv->recent[k]);
+        if (srv->clients[i] == 0) return; // 佇列溢位被斷線
+    }
+}
+
+// 送給本 shard 的所有 client：每個收件者只多一個指標與參考計數，不複製內容
+// except_idx 表示排除某個 client（例如訊息來源者不需要收到回送）
+static void broadcast_local(struct server *srv, int except_idx, struct msgbuf *m) {
+    recent_add(srv, m);
+    for (int i = 0; i < srv->nslots; i++) {
+        if (srv->clients[i] > 0 && i != except_idx) send_msg(srv, i, m);
+    }
+}
+
+// 私訊送給本 shard 的 slot i；slot 上的 client 已經換人（暱稱不同）就不送
+static void deliver_local(struct server *srv, int i, const char *nick, struct msgbuf *m) {
+    if (i < srv->nslots && srv->clients[i] > 0 && strcasecmp(srv->names[i], nick) == 0) send_msg(srv, i, m);
+}
+
+// 把一則訊息放進另一個 shard 的 inbox；inbox 原本是空的才需要寫 eventfd 喚醒
+// slot 為 xmsg 的種類（XMSG_*）或私訊收件者的 slot；name 為頻道或收件者暱稱
+static void inbox_post(struct server *dst, struct msgbuf *msg, int slot, const char *name) {
+    struct xmsg *m = slab_alloc(sizeof(*m));
+    if (!m) return;
+    m->next = NULL;
+    m->msg  = msg ? msg_ref(msg) : NULL;
+    m->slot = slot;
+    if (name) snprintf(m->name, NAME_LEN, "%s", name);
+
+    pthread_mutex_lock(&dst->inbox.lock);
+    int was_empty = dst->inbox.head == NULL;
+    if (dst->inbox.tail) dst->inbox.tail->next = m;
+    else                 dst->inbox.head = m;
+    dst->inbox.tail = m;
+    pthread_mutex_unlock(&dst->inbox.lock);
+
+    if (was_empty) {
+        uint64_t one = 1;
+        ssize_t w = write(dst->inbox.efd, &one, sizeof(one));
+        (void)w;
+    }
+}
+
+// 叫醒某個 shard（用於關閉 server）
+static void inbox_wake(struct server *dst) {
+    uint64_t one = 1;
+    ssize_t w = write(dst->inbox.efd, &one, sizeof(one));
+    (void)w;
+}
+
+// 廣播訊息給所有 client：本地 client 直接送，其他 shard 的 client 經由各自的 inbox
+// except_idx 表示排除本 shard 的某個 client（例如訊息來源者不需要收到回送）
+static void broadcast_to_all(struct server *srv, int except_idx, struct msgbuf *m) {
+    hist_append(srv->hist, m);
+    broadcast_local(srv, except_idx, m);
+    for (int k = 0; k < nshards; k++) {
+        if (k != srv->id) inbox_post(&shards[k], m, XMSG_BROADCAST, NULL);
+    }
+}
+
+// 處理 inbox：一次取出整串訊息再逐一送給本地 client
+// 回傳 0 表示 server 正在關閉
+// 要求熱重啟：新的執行檔可以執行才設定 restarting，回傳 1 表示 shard 0 要停下事件迴圈
+static int restart_begin(void) {
+    if (!self_path[0] || access(self_path, X_OK) < 0) {
+        fprintf(stderr, "restart: cannot execute %s\n", self_path[0] ? self_path : "(unknown)");
+        return 0;
+    }
+    printf("Restarting: handing connections over to a new %s ...\n", self_path);
+    restarting = 1;
+    return 1;
+}
+
+// SIGUSR2：只設定旗標並喚醒 shard 0（eventfd 的 write 可以在 signal handler 中呼叫）
+static void restart_signal_handler(int sig) {
+    (void)sig;
+    int saved = errno;
+    uint64_t one = 1;
+    restart_signal = 1;
+    ssize_t r = write(shards[0].inbox.efd, &one, sizeof(one));
+    (void)r;
+    errno = saved;
+}
+
+static int drain_inbox(struct server *srv) {
+    uint64_t cnt;
+    ssize_t r = read(srv->inbox.efd, &cnt, sizeof(cnt));
+    (void)r;
+
+    pthread_mutex_lock(&srv->inbox.lock);
+    struct xmsg *m = srv->inbox.head;
+    srv->inbox.head = srv->inbox.tail = NULL;
+    pthread_mutex_unlock(&srv->inbox.lock);
+
+    while (m) {
+        struct xmsg *next = m->next;
+        if (m->slot == XMSG_BROADCAST)       broadcast_local(srv, -1, m->msg);
+        else if (m->slot == XMSG_ROOM)       room_send_local(srv, room_find(srv, m->name), -1, m->msg);
+        else if (m->slot == XMSG_ROOM_STATS) room_print_stats(srv);
+        else if (m->slot == XMSG_SLAB_STATS) slab_print_stats(srv);
+        else                                 deliver_local(srv, m->slot, m->name, m->msg);
+        msg_unref(m->msg);
+        slab_free(m);
+        m = next;
+    }
+    if (srv->id == 0 && restart_signal) {
+        restart_signal = 0;
+        if (restart_begin()) return 0;
+    }
+    return !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+}
+
+// ---------------- client 表與 slot 配置 ----------------
+
+// 把陣列 *p 從 oldn 格擴充到 newn 格，新的部分清為 0
+static int grow_array(void *p, size_t elem, int oldn, int newn) {
+    void **pp = p;
+    char *a = realloc(*pp, elem * (size_t)newn);
+    if (!a) return -1;
+    memset(a + elem * (size_t)oldn, 0, elem * (size_t)(newn - oldn));
+    *pp = a;
+    return 0;
+}
+
+// client 表倍增（上限 max_clients）；所有以 slot 為索引的陣列一起擴充
+// 中途失敗時已擴充的陣列只是比 cap 大，不影響正確性
+static int client_table_grow(struct server *srv) {
+    int old = srv->cap;
+    int cap = old ? old * 2 : CLIENTS_INIT;
+    if (cap > max_clients) cap = max_clients;
+    if (cap <= old) return -1;
+    if (grow_array(&srv->freelist,   sizeof(*srv->freelist),   old, cap) < 0 ||
+        grow_array(&srv->clients,    sizeof(*srv->clients),    old, cap) < 0 ||
+        grow_array(&srv->names,      sizeof(*srv->names),      old, cap) < 0 ||
+        grow_array(&srv->proto,      sizeof(*srv->proto),      old, cap) < 0 ||
+        grow_array(&srv->outq,       sizeof(*srv->outq),       old, cap) < 0 ||
+        grow_array(&srv->inbuf,      sizeof(*srv->inbuf),      old, cap) < 0 ||
+        grow_array(&srv->dirty_mark, sizeof(*srv->dirty_mark), old, cap) < 0 ||
+        grow_array(&srv->dirty,      sizeof(*srv->dirty),      old, cap) < 0 ||
+        grow_array(&srv->joined,     sizeof(*srv->joined),     old, cap) < 0 ||
+        grow_array(&srv->timers,     sizeof(*srv->timers),     old, cap) < 0 ||
+        grow_array(&srv->rate,       sizeof(*srv->rate),       old, cap) < 0 ||
+        grow_array(&srv->paused,     sizeof(*srv->paused),     old, cap) < 0)
+        return -1;
+    if (srv->ring &&
+        (grow_array(&srv->ring->gen,      sizeof(*srv->ring->gen),      old, cap) < 0 ||
+         grow_array(&srv->ring->inflight, sizeof(*srv->ring->inflight), old, cap) < 0))
+        return -1;
+    srv->cap = cap;
+    return 0;
+}
+
+// 取得一個空的 slot：優先重用 free list，否則用下一個沒用過的 slot，表滿了就倍增
+// 回傳 -1 表示所有 shard 合計已達 max_clients 或記憶體不足
+static int slot_alloc(struct server *srv) {
+    if (__atomic_add_fetch(&nclients, 1, __ATOMIC_RELAXED) > max_clients) {
+        __atomic_sub_fetch(&nclients, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (srv->nfree > 0) return srv->freelist[--srv->nfree];
+    if (srv->nslots == srv->cap && client_table_grow(srv) < 0) {
+        __atomic_sub_fetch(&nclients, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return srv->nslots++;
+}
+
+static void slot_free(struct server *srv, int i) {
+    srv->freelist[srv->nfree++] = i;
+    __atomic_sub_fetch(&nclients, 1, __ATOMIC_RELAXED);
+}
+
+// 把 RLIMIT_NOFILE 提高到足以容納 max_clients 條連線；soft limit 先拉到 hard limit，
+// 還不夠時嘗試提高 hard limit（需要權限），仍然不夠就把 max_clients 降到可用的 fd 數
+static void raise_nofile(void) {
+    struct rlimit rl;
+    rlim_t need = (rlim_t)max_clients + FD_RESERVE * (rlim_t)(nshards + 1);
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) { perror("getrlimit"); return; }
+    if (rl.rlim_cur >= need) return;
+
+    struct rlimit want = { need, rl.rlim_max > need ? rl.rlim_max : need };
+    if (setrlimit(RLIMIT_NOFILE, &want) < 0) {
+        want.rlim_cur = rl.rlim_max;
+        want.rlim_max = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &want) < 0) want.rlim_cur = rl.rlim_cur;
+    }
+    if (want.rlim_cur < need) {
+        rlim_t reserve = FD_RESERVE * (rlim_t)(nshards + 1);
+        int avail = want.rlim_cur > reserve ? (int)(want.rlim_cur - reserve) : 1;
+        fprintf(stderr, "RLIMIT_NOFILE is %llu, max clients lowered from %d to %d\n",
+                (unsigned long long)want.rlim_cur, max_clients, avail);
+        max_clients = avail;
+    }
+}
+
+// listen() 的 backlog 會被 kernel 截到 net.core.somaxconn；-L 比它大時提醒，否則重連風暴時還是會丟 SYN
+static void check_somaxconn(void) {
+    FILE *f = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (!f) return;
+    int max;
+    if (fscanf(f, "%d", &max) == 1 && max < listen_backlog)
+        fprintf(stderr, "warning: listen backlog %d is capped at net.core.somaxconn = %d\n", listen_backlog, max);
+    fclose(f);
+}
+
+// ---------------- timer wheel ----------------
+
+static uint64_t mono_ms(void) {
+    return mono_ns() / 1000000;
+}
+
+static void wheel_init(struct timer_wheel *w) {
+    memset(w, 0, sizeof(*w));
+    memset(w->head, 0xff, sizeof(w->head)); // 全部 -1
+    w->now = mono_ms() / TIMER_TICK_MS;
+}
+
+// 把 slot i 的計時器放進 wheel：選最低的一層，使到期時間與目前時間落在同一圈之內
+static void timer_link(struct server *srv, int i) {
+    struct timer_wheel *w = &srv->wheel;
+    struct timer *t = &srv->timers[i];
+    if (t->expire <= w->now) t->expire = w->now + 1;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           (t->expire >> (WHEEL_BITS * level)) - (w->now >> (WHEEL_BITS * level)) >= WHEEL_SIZE)
+        level++;
+    int idx = (int)(t->expire >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    int *head = &w->head[level][idx];
+    t->bucket = level * WHEEL_SIZE + idx;
+    t->prev   = -1;
+    t->next   = *head;
+    if (*head >= 0) srv->timers[*head].prev = i;
+    *head = i;
+    w->used[level] |= 1ULL << idx;
+    w->count++;
+}
+
+static void timer_unlink(struct server *srv, int i) {
+    struct timer_wheel *w = &srv->wheel;
+    struct timer *t = &srv->timers[i];
+    if (t->bucket < 0) return;
+    int level = t->bucket / WHEEL_SIZE, idx = t->bucket % WHEEL_SIZE;
+    if (t->prev >= 0) srv->timers[t->prev].next = t->next;
+    else              w->head[level][idx] = t->next;
+    if (t->next >= 0) srv->timers[t->next].prev = t->prev;
+    if (w->head[level][idx] < 0) w->used[level] &= ~(1ULL << idx);
+    t->bucket = -1;
+    w->count--;
+}
+
+// 設定 slot i 的計時器：state 狀態在 secs 秒後到期（secs 為 0 表示不需要計時）
+static void timer_arm(struct server *srv, int i, int state, int secs) {
+    struct timer *t = &srv->timers[i];
+    timer_unlink(srv, i);
+    t->state = (unsigned char)(secs > 0 ? state : TIMER_NONE);
+    if (secs <= 0) return;
+    t->expire = srv->wheel.now + (uint64_t)secs * 1000 / TIMER_TICK_MS;
+    timer_link(srv, i);
+}
+
+// 等 NICK（有設定 -N 的話），否則直接進入閒置檢查
+static void timer_begin(struct server *srv, int i) {
+    if (nick_timeout > 0) timer_arm(srv, i, TIMER_NICK, nick_timeout);
+    else                  timer_arm(srv, i, TIMER_IDLE, idle_timeout);
+}
+
+// 新連線：有歷史訊息要重播時，先等 GREET_TICKS 個 tick（TIMER_GREET）或 client 送來第一行，
+// 讓連線後馬上送出的 PROTO 先生效，重播就能用協商好的格式（壓縮）送出
+static void timer_start(struct server *srv, int i) {
+    struct timer *t = &srv->timers[i];
+    t->bucket  = -1;
+    t->last_rx = srv->wheel.now;
+    if (srv->nrecent == 0) {
+        timer_begin(srv, i);
+        return;
+    }
+    t->state  = TIMER_GREET;
+    t->expire = srv->wheel.now + GREET_TICKS;
+    timer_link(srv, i);
+}
+
+// 送出新連線的歷史重播，並開始 NICK / 閒置的計時（TIMER_GREET 到期或 client 送來第一行時）
+static void client_greet(struct server *srv, int i) {
+    if (srv->timers[i].state != TIMER_GREET) return;
+    timer_begin(srv, i);
+    recent_replay(srv, i, history_len); // 讓新來的人看到最近的對話
+}
+
+// 計時器到期：依狀態送 PING 或斷線
+// 收到資料時只記錄 last_rx，到期時若期間有收到資料，就從 last_rx 重新計算期限
+static void timer_expire(struct server *srv, int i) {
+    struct timer *t = &srv->timers[i];
+    uint64_t idle_ticks = (uint64_t)idle_timeout * 1000 / TIMER_TICK_MS;
+    switch (t->state) {
+    case TIMER_GREET:
+        client_greet(srv, i);
+        return;
+    case TIMER_NICK:
+        printf("Client %s (fd=%d) did not send NICK in time.\n", srv->names[i], srv->clients[i]);
+        drop_client(srv, i);
+        return;
+    case TIMER_IDLE:
+        if (t->last_rx + idle_ticks > srv->wheel.now) {
+            t->expire = t->last_rx + idle_ticks;
+            timer_link(srv, i);
+            return;
+        }
+        {
+            char ping[32];
+            int n = snprintf(ping, sizeof(ping), "PING %llu\n", (unsigned long long)srv->wheel.now);
+            struct msgbuf *m = msg_new(ping, (size_t)n);
+            if (m) {
+                m->type = FRAME_PING;
+                send_msg(srv, i, m);
+                msg_unref(m);
+            }
+        }
+        if (srv->clients[i] == 0) return;
+        timer_arm(srv, i, TIMER_PING, PONG_TIMEOUT);
+        return;
+    case TIMER_PING:
+        // PING 送出之後有收到任何資料就算活著
+        if (t->last_rx + (uint64_t)PONG_TIMEOUT * 1000 / TIMER_TICK_MS >= t->expire) {
+            t->state  = TIMER_IDLE;
+            t->expire = t->last_rx + idle_ticks;
+            timer_link(srv, i);
+            return;
+        }
+        printf("Client %s (fd=%d) ping timeout.\n", srv->names[i], srv->clients[i]);
+        drop_client(srv, i);
+        return;
+    }
+}
+
+// 把上一層第 idx 格的計時器重新分配到較低的層
+static void wheel_cascade(struct server *srv, int level, int idx) {
+    struct timer_wheel *w = &srv->wheel;
+    int i = w->head[level][idx];
+    w->head[level][idx] = -1;
+    w->used[level] &= ~(1ULL << idx);
+    while (i >= 0) {
+        int next = srv->timers[i].next;
+        srv->timers[i].bucket = -1;
+        w->count--;
+        timer_link(srv, i);
+        i = next;
+    }
+}
+
+// 每次事件迴圈醒來時呼叫：把 wheel 推進到目前時間，處理所有到期的計時器
+static void timers_run(struct server *srv) {
+    struct timer_wheel *w = &srv->wheel;
+    tick_ns = mono_ns();
+    srv->now_ms = tick_ns / 1000000;
+    uint64_t target = srv->now_ms / TIMER_TICK_MS;
+    if (w->count == 0) { w->now = target; return; }
+    while (w->now < target) {
+        w->now++;
+        // level 0 轉完一圈：從上一層的下一格開始 cascade，該層也轉完一圈就再往上
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (w->now & ((1ULL << (WHEEL_BITS * level)) - 1)) break;
+            wheel_cascade(srv, level, (int)(w->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+        }
+        int idx = (int)(w->now & (WHEEL_SIZE - 1));
+        int i;
+        while ((i = w->head[0][idx]) >= 0) {
+            timer_unlink(srv, i);
+            timer_expire(srv, i);
+        }
+        if (w->count == 0) { w->now = target; break; }
+    }
+}
+
+// 到下一個可能有計時器到期的 tick 還有幾 ms，給 select/epoll/io_uring 當等待時間；-1 表示沒有計時器
+// level 0 找下一個非空的格子；上層只要有計時器，最晚在 level 0 轉完一圈時要醒來 cascade
+static int timers_next_ms(struct server *srv) {
+    struct timer_wheel *w = &srv->wheel;
+    if (w->count == 0) return -1;
+    int cur = (int)(w->now & (WHEEL_SIZE - 1));
+    uint64_t ticks = (uint64_t)(WHEEL_SIZE - cur); // 到下一次 cascade
+    if (w->used[0]) {
+        // 把 cur + 1 轉到 bit 0，最低的 1 就是下一個非空的格子
+        int sh = (cur + 1) & (WHEEL_SIZE - 1);
+        uint64_t rot = (w->used[0] >> sh) | (sh ? w->used[0] << (WHEEL_SIZE - sh) : 0);
+        uint64_t d = (uint64_t)__builtin_ctzll(rot) + 1;
+        if (d < ticks) ticks = d;
+    }
+    uint64_t at = (w->now + ticks) * TIMER_TICK_MS, now = mono_ms();
+    return at > now ? (int)(at - now) : 0;
+}
+
+// ---------------- 接收速率限制 ----------------
+
+// 依經過的時間補充 token，最多補到一秒的額度
+static void rate_refill(struct ratelimit *rl, uint64_t now) {
+    uint64_t dt = now - rl->last;
+    rl->last = now;
+    if (rate_msgs) {
+        rl->msgs += (int64_t)(dt * (uint64_t)rate_msgs);
+        if (rl->msgs > (int64_t)rate_msgs * 1000) rl->msgs = (int64_t)rate_msgs * 1000;
+    }
+    if (rate_bytes) {
+        rl->bytes += (int64_t)(dt * (uint64_t)rate_bytes);
+        if (rl->bytes > (int64_t)rate_bytes * 1000) rl->bytes = (int64_t)rate_bytes * 1000;
+    }
+}
+
+// 新連線：兩個 bucket 都是滿的
+static void rate_start(struct server *srv, int i) {
+    struct ratelimit *rl = &srv->rate[i];
+    rl->msgs      = (int64_t)rate_msgs * 1000;
+    rl->bytes     = (int64_t)rate_bytes * 1000;
+    rl->last      = srv->now_ms;
+    rl->pause_pos = -1;
+    rl->reads_off = 0;
+    rl->recv_off  = 0;
+}
+
+static int rate_exceeded(const struct ratelimit *rl) {
+    return (rate_msgs && rl->msgs <= 0) || (rate_bytes && rl->bytes <= 0);
+}
+
+// 處理一行之前扣除額度；回傳 0 表示額度已經用完，這一行要留到之後
+static int rate_take(struct server *srv, int i, size_t len) {
+    struct ratelimit *rl = &srv->rate[i];
+    if (rate_exceeded(rl)) return 0;
+    rl->msgs  -= 1000;
+    rl->bytes -= (int64_t)(len + 1) * 1000;
+    return 1;
+}
+
+// 超過額度：暫停讀取 client i。資料留在 kernel 的 socket buffer，TCP 的流量控制會讓對方慢下來，
+// 不會丟掉任何訊息。epoll 拿掉 EPOLLIN；io_uring 取消 multishot recv；select 不放進 readfds
+static void rate_pause(struct server *srv, int i) {
+    struct ratelimit *rl = &srv->rate[i];
+    if (rl->pause_pos < 0) {
+        rl->pause_pos = srv->npaused;
+        srv->paused[srv->npaused++] = i;
+        METRIC_ADD(srv->stats.rate_pauses, 1);
+    }
+    if (rl->reads_off) return;
+    rl->reads_off = 1;
+    if (srv->backend == BACKEND_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLOUT | EPOLLET;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(srv->epfd, EPOLL_CTL_MOD, srv->clients[i], &ev);
+    } else if (srv->backend == BACKEND_URING) {
+        struct io_uring_sqe *sqe = uring_get_sqe(srv->ring);
+        if (!sqe) return;
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->fd        = -1;
+        sqe->addr      = uring_slot_data(srv->ring, UOP_RECV, i);
+        sqe->user_data = UOP_CANCEL;
+    }
+}
+
+// 從暫停清單移除（與最後一個交換）
+static void rate_unlist(struct server *srv, int i) {
+    struct ratelimit *rl = &srv->rate[i];
+    if (rl->pause_pos < 0) return;
+    int moved = srv->paused[--srv->npaused];
+    srv->paused[rl->pause_pos] = moved;
+    srv->rate[moved].pause_pos = rl->pause_pos;
+    rl->pause_pos = -1;
+}
+
+// 恢復讀取。epoll 以 EPOLL_CTL_MOD 加回 EPOLLIN 時，kernel 會重新檢查，已經在 buffer 裡的資料
+// 也會產生事件；io_uring 若 recv 已經結束就重新提交，取消還沒完成的話由完成事件負責重新提交
+static void rate_reads_on(struct server *srv, int i) {
+    struct ratelimit *rl = &srv->rate[i];
+    rl->reads_off = 0;
+    if (srv->backend == BACKEND_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(srv->epfd, EPOLL_CTL_MOD, srv->clients[i], &ev);
+    } else if (srv->backend == BACKEND_URING && rl->recv_off) {
+        rl->recv_off = 0;
+        uring_prep_recv(srv, i);
+    }
+}
+
+// 把暫停時還沒處理的資料（一定從行首開始）存起來；io_uring 取消 recv 之前已經收進來的資料也會接在後面
+static void rate_hold(struct server *srv, int i, const char *p, size_t n) {
+    struct linebuf *lb = &srv->inbuf[i];
+    if (lb->held_len + n > lb->held_cap) {
+        size_t cap = lb->held_cap ? lb->held_cap : BUF_SIZE;
+        while (cap < lb->held_len + n) cap *= 2;
+        char *held = slab_alloc(cap + 1); // feed_client 需要多一個 byte 放 '\0'
+        if (!held) return;
+        if (lb->held_len) memcpy(held, lb->held, lb->held_len);
+        slab_free(lb->held);
+        lb->held     = held;
+        lb->held_cap = cap;
+    }
+    memcpy(lb->held + lb->held_len, p, n);
+    lb->held_len += n;
+}
+
+// 處理完一批資料後呼叫：額度剛好用完時先暫停，不必再讀一次才發現，回傳 1 表示已暫停
+static int rate_check(struct server *srv, int i) {
+    if (srv->clients[i] == 0) return 0;
+    if (srv->rate[i].pause_pos < 0 && !rate_exceeded(&srv->rate[i])) return 0;
+    rate_pause(srv, i);
+    return 1;
+}
+
+// 每個 tick：token 已經補回來的 client 先處理存起來的資料，沒有再次超過額度才恢復讀取
+static void rate_resume_due(struct server *srv) {
+    for (int k = srv->npaused - 1; k >= 0; k--) {
+        if (k >= srv->npaused) continue; // 處理過程中有 client 斷線，清單變短了
+        int i = srv->paused[k];
+        struct ratelimit *rl = &srv->rate[i];
+        rate_refill(rl, srv->now_ms);
+        if (rate_exceeded(rl)) continue;
+        rate_unlist(srv, i);
+
+        struct linebuf *lb = &srv->inbuf[i];
+        if (lb->held_len > 0) {
+            char *held = lb->held;
+            size_t n = lb->held_len;
+            lb->held = NULL;
+            lb->held_len = lb->held_cap = 0;
+            feed_client(srv, i, held, n); // 可能再次暫停，剩下的存進新的 held
+            slab_free(held);
+            if (srv->clients[i] == 0) continue;
+        }
+        if (!rate_check(srv, i)) rate_reads_on(srv, i);
+    }
+}
+
+// 到最早可以恢復的 client 還有幾 ms；-1 表示沒有暫停中的 client
+static int rate_next_ms(struct server *srv) {
+    int64_t best = -1;
+    for (int k = 0; k < srv->npaused; k++) {
+        const struct ratelimit *rl = &srv->rate[srv->paused[k]];
+        int64_t need = 0; // 補到正數所需的 ms
+        if (rate_msgs && rl->msgs <= 0) need = -rl->msgs / rate_msgs + 1;
+        if (rate_bytes && rl->bytes <= 0 && -rl->bytes / rate_bytes + 1 > need) need = -rl->bytes / rate_bytes + 1;
+        int64_t at = (int64_t)(rl->last + (uint64_t)need) - (int64_t)srv->now_ms;
+        if (at < 0) at = 0;
+        if (best < 0 || at < best) best = at;
+    }
+    return (int)best;
+}
+
+// 事件迴圈的等待時間：計時器與暫停中 client 兩者較早的一個
+static int loop_timeout_ms(struct server *srv) {
+    if (srv->ndirty > 0) return 1;     // 上個 tick 有送不出去的 client（配置失敗等），很快再試一次
+    int a = timers_next_ms(srv), b = rate_next_ms(srv);
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+// ---------------- 名字索引（暱稱、頻道共用） ----------------
+
+// 不分大小寫的 FNV-1a
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) h = (h ^ (uint32_t)tolower((unsigned char)*name)) * 16777619u;
+    return h;
+}
+
+// 找出 name 所在（或應該放入）的位置；ix->cap 必須大於 0
+static unsigned name_probe(const struct name_index *ix, const char *name) {
+    unsigned mask = ix->cap - 1, k = name_hash(name) & mask;
+    while (ix->tab[k].name[0] && strcasecmp(ix->tab[k].name, name) != 0) k = (k + 1) & mask;
+    return k;
+}
+
+// 找 name，不存在回傳 NULL
+static struct name_entry *name_find(const struct name_index *ix, const char *name) {
+    if (ix->cap == 0) return NULL;
+    struct name_entry *e = &ix->tab[name_probe(ix, name)];
+    return e->name[0] ? e : NULL;
+}
+
+// 確保還能再放一筆（必要時倍增），失敗回傳 -1
+static int name_reserve(struct name_index *ix) {
+    if ((ix->count + 1) * 2 <= ix->cap) return 0;
+    unsigned cap = ix->cap ? ix->cap * 2 : NAME_INDEX_INIT;
+    struct name_entry *old = ix->tab;
+    unsigned oldcap = ix->cap;
+    ix->tab = calloc(cap, sizeof(*ix->tab));
+    if (!ix->tab) { ix->tab = old; return -1; }
+    ix->cap = cap;
+    for (unsigned k = 0; k < oldcap; k++) {
+        if (old[k].name[0]) ix->tab[name_probe(ix, old[k].name)] = old[k];
+    }
+    free(old);
+    return 0;
+}
+
+// 刪除位置 k，並把後面同一串的資料往前搬，維持 linear probing 的查找不中斷
+static void name_erase(struct name_index *ix, unsigned k) {
+    unsigned mask = ix->cap - 1, j = k;
+    ix->tab[k].name[0] = '\0';
+    ix->count--;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!ix->tab[j].name[0]) return;
+        unsigned home = name_hash(ix->tab[j].name) & mask;
+        // home 落在 (k, j] 之間的資料不需要搬（環狀比較）
+        if (((j - home) & mask) < ((j - k) & mask)) continue;
+        ix->tab[k] = ix->tab[j];
+        ix->tab[j].name[0] = '\0';
+        k = j;
+    }
+}
+
+// ---------------- 暱稱索引 ----------------
+
+// 把 client i 的暱稱從 names[i] 改成 name 並更新索引；回傳 -1 表示暱稱已被別人使用（或記憶體不足）
+// names[i] 為空字串表示還沒有登記過
+static int nick_set(struct server *srv, int i, const char *name) {
+    int rc = 0;
+    pthread_mutex_lock(&nicks_lock);
+    if (name_reserve(&nicks) < 0) {
+        rc = -1;
+    } else {
+        struct name_entry *e = &nicks.tab[name_probe(&nicks, name)];
+        if (e->name[0] && (e->shard != srv->id || e->idx != i)) {
+            rc = -1;                        // 別人的名字
+        } else {
+            if (!e->name[0]) {
+                if (srv->names[i][0]) name_erase(&nicks, name_probe(&nicks, srv->names[i]));
+                e = &nicks.tab[name_probe(&nicks, name)]; // 刪除可能搬動了資料，重新找位置
+                nicks.count++;
+            }
+            snprintf(e->name, NAME_LEN, "%s", name); // 同一個人只改大小寫時直接覆蓋
+            e->shard = srv->id;
+            e->idx   = i;
+            snprintf(srv->names[i], NAME_LEN, "%s", name);
+        }
+    }
+    pthread_mutex_unlock(&nicks_lock);
+    return rc;
+}
+
+// client i 離線時把暱稱從索引移除
+static void nick_clear(struct server *srv, int i) {
+    if (!srv->names[i][0]) return;
+    pthread_mutex_lock(&nicks_lock);
+    struct name_entry *e = name_find(&nicks, srv->names[i]);
+    if (e && e->shard == srv->id && e->idx == i) name_erase(&nicks, (unsigned)(e - nicks.tab));
+    pthread_mutex_unlock(&nicks_lock);
+    srv->names[i][0] = '\0';
+}
+
+// 以暱稱找 client（不分大小寫），回傳 0 並填入 shard、slot 與登記時的暱稱寫法；找不到回傳 -1
+static int nick_lookup(const char *name, int *shard, int *slot, char *canon) {
+    int rc = -1;
+    pthread_mutex_lock(&nicks_lock);
+    struct name_entry *e = name_find(&nicks, name);
+    if (e) {
+        *shard = e->shard;
+        *slot  = e->idx;
+        memcpy(canon, e->name, NAME_LEN);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&nicks_lock);
+    return rc;
+}
+
+// "anon<數字>" 保留給預設名稱
+static int nick_reserved(const char *name) {
+    if (strncasecmp(name, "anon", 4) != 0 || !name[4]) return 0;
+    for (const char *p = name + 4; *p; p++) {
+        if (!isdigit((unsigned char)*p)) return 0;
+    }
+    return 1;
+}
+
+// ---------------- 頻道 ----------------
+
+// 頻道名稱："#" 開頭，之後是 1 個以上的可印字元（不含空白與 '['、']'）
+static int room_valid(const char *name) {
+    size_t n = strlen(name);
+    if (n < 2 || n >= NAME_LEN || name[0] != '#') return 0;
+    for (const char *p = name + 1; *p; p++) {
+        if (!isgraph((unsigned char)*p) || *p == '[' || *p == ']') return 0;
+    }
+    return 1;
+}
+
+// 找本 shard 的頻道，沒有本地成員時回傳 NULL
+static struct room *room_find(struct server *srv, const char *name) {
+    struct name_entry *e = name_find(&srv->room_index, name);
+    return e ? srv->rooms[e->idx] : NULL;
+}
+
+static struct room *room_create(struct server *srv, const char *name) {
+    if (srv->nrooms == srv->roomcap) {
+        int cap = srv->roomcap ? srv->roomcap * 2 : 8;
+        if (grow_array(&srv->rooms, sizeof(*srv->rooms), srv->roomcap, cap) < 0) return NULL;
+        srv->roomcap = cap;
+    }
+    struct room *r = calloc(1, sizeof(*r));
+    if (!r || name_reserve(&srv->room_index) < 0) { free(r); return NULL; }
+    snprintf(r->name, NAME_LEN, "%s", name);
+    r->idx = srv->nrooms;
+    srv->rooms[srv->nrooms++] = r;
+
+    struct name_entry *e = &srv->room_index.tab[name_probe(&srv->room_index, name)];
+    snprintf(e->name, NAME_LEN, "%s", name);
+    e->idx = r->idx;
+    srv->room_index.count++;
+    return r;
+}
+
+// 最後一個本地成員離開：從索引與 rooms[] 移除（與最後一個頻道交換位置）
+static void room_destroy(struct server *srv, struct room *r) {
+    name_erase(&srv->room_index, name_probe(&srv->room_index, r->name));
+    struct room *last = srv->rooms[--srv->nrooms];
+    if (last != r) {
+        srv->rooms[r->idx] = last;
+        last->idx = r->idx;
+        name_find(&srv->room_index, last->name)->idx = last->idx;
+    }
+    free(r->members);
+    free(r);
+}
+
+// client i 在頻道 r 的 room_ref 編號，不是成員回傳 -1
+static int room_ref_of(struct server *srv, int i, const struct room *r) {
+    struct joined *j = &srv->joined[i];
+    for (int k = 0; k < j->n; k++) {
+        if (j->refs[k].room == r) return k;
+    }
+    return -1;
+}
+
+// 把 client i 加入頻道 r；回傳 -1 表示加入的頻道太多或記憶體不足
+static int room_add(struct server *srv, struct room *r, int i) {
+    struct joined *j = &srv->joined[i];
+    if (j->n == ROOMS_PER_CLIENT) return -1;
+    if (!j->refs && !(j->refs = slab_alloc(ROOMS_PER_CLIENT * sizeof(*j->refs)))) return -1;
+    if (r->nmembers == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 4;
+        if (grow_array(&r->members, sizeof(*r->members), r->cap, cap) < 0) return -1;
+        r->cap = cap;
+    }
+    j->refs[j->n].room = r;
+    j->refs[j->n].pos  = r->nmembers;
+    j->n++;
+    r->members[r->nmembers++] = i;
+    return 0;
+}
+
+// 把 client i 的第 k 個頻道移除：最後一個成員搬到 i 的位置，並更新它記住的位置
+static void room_remove(struct server *srv, int i, int k) {
+    struct joined *j = &srv->joined[i];
+    struct room *r = j->refs[k].room;
+    int pos = j->refs[k].pos;
+    int moved = r->members[--r->nmembers];
+    if (moved != i) {
+        r->members[pos] = moved;
+        srv->joined[moved].refs[room_ref_of(srv, moved, r)].pos = pos;
+    }
+    j->refs[k] = j->refs[--j->n];
+    if (r->nmembers == 0) room_destroy(srv, r);
+}
+
+// client 離線：離開所有頻道（不另外通知其他成員）
+static void room_leave_all(struct server *srv, int i) {
+    struct joined *j = &srv->joined[i];
+    while (j->n > 0) room_remove(srv, i, j->n - 1);
+    slab_free(j->refs);
+    j->refs = NULL;
+}
+
+// 送給本 shard 頻道 r 的成員（r 可以是 NULL，表示本 shard 沒有成員）
+// 由後往前送：送的過程中收件者可能因佇列溢位被斷線而離開頻道，被搬到它位置的是已經送過的成員
+static void room_send_local(struct server *srv, struct room *r, int except_idx, struct msgbuf *m) {
+    if (!r) return;
+    int n = r->nmembers;
+    if (except_idx >= 0 && room_ref_of(srv, except_idx, r) >= 0) n--;
+    r->msgs++;
+    r->deliveries += (uint64_t)n;
+    r->bytes      += (uint64_t)n * m->len;
+    for (int k = r->nmembers - 1; k >= 0; k--) {
+        if (r->members[k] != except_idx) send_msg(srv, r->members[k], m);
+    }
+}
+
+// 送給頻道 name 的所有成員：本地成員直接送，其他 shard 經由各自的 inbox
+static void room_send(struct server *srv, const char *name, int except_idx, struct msgbuf *m) {
+    hist_append(srv->hist, m);
+    room_send_local(srv, room_find(srv, name), except_idx, m);
+    for (int k = 0; k < nshards; k++) {
+        if (k != srv->id) inbox_post(&shards[k], m, XMSG_ROOM, name);
+    }
+}
+
+// 送出 "[#room] text\n" 形式的頻道通知
+static void room_notice(struct server *srv, const char *name, const char *text) {
+    struct msgbuf *m = msg_line(name, text, strlen(text));
+    if (!m) return;
+    m->flags = FRAME_F_ROOM;
+    room_send(srv, name, -1, m);
+    msg_unref(m);
+}
+
+// JOIN / PART：成功時通知頻道所有成員（包括自己）
+static void room_join(struct server *srv, int i, const char *name) {
+    char text[NAME_LEN + 16];
+    if (!room_valid(name)) {
+        const char *msg = "Invalid room name\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    struct room *r = room_find(srv, name);
+    if (r && room_ref_of(srv, i, r) >= 0) return; // 已經在頻道裡
+    int created = !r;
+    if (created && !(r = room_create(srv, name))) return;
+    if (room_add(srv, r, i) < 0) {
+        if (created) room_destroy(srv, r);
+        const char *msg = "Too many rooms\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    printf("Client %s joined %s\n", srv->names[i], r->name);
+    snprintf(text, sizeof(text), "%s joined", srv->names[i]);
+    room_notice(srv, r->name, text);
+}
+
+static void room_part(struct server *srv, int i, const char *name) {
+    char text[NAME_LEN + 16];
+    struct room *r = room_find(srv, name);
+    int k = r ? room_ref_of(srv, i, r) : -1;
+    if (k < 0) {
+        const char *msg = "Not in that room\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    char rname[NAME_LEN];
+    snprintf(rname, sizeof(rname), "%s", r->name);
+    printf("Client %s left %s\n", srv->names[i], rname);
+    snprintf(text, sizeof(text), "%s left", srv->names[i]);
+    room_notice(srv, rname, text); // 先通知（自己也會收到），再離開
+    // 通知的過程中 client i 可能因佇列溢位已被斷線（已經離開所有頻道）
+    if (srv->clients[i] > 0 && (r = room_find(srv, rname)) && (k = room_ref_of(srv, i, r)) >= 0)
+        room_remove(srv, i, k);
+}
+
+// 印出本 shard 各頻道的統計（server 端 /rooms 指令）
+static void room_print_stats(struct server *srv) {
+    for (int k = 0; k < srv->nrooms; k++) {
+        struct room *r = srv->rooms[k];
+        printf("shard %d %s: %d members, %llu msgs, %llu deliveries, %llu bytes\n", srv->id, r->name,
+               r->nmembers, (unsigned long long)r->msgs, (unsigned long long)r->deliveries,
+               (unsigned long long)r->bytes);
+    }
+}
+
+// 關閉某個 slot 的 client 並清除資源
+// close() 會自動把 fd 從 epoll 的監聽集合移除
+// io_uring 模式下 slot 世代加一，之後這個 slot 舊的完成事件都會被忽略
+static void drop_client(struct server *srv, int i) {
+    printf("Client %s (fd=%d) disconnected.\n", srv->names[i], srv->clients[i]);
+    if (srv->ring) {
+        // 還在進行中的 multishot recv 會因 shutdown 而結束
+        shutdown(srv->clients[i], SHUT_RDWR);
+        srv->ring->gen[i]++;
+    }
+    timer_unlink(srv, i);
+    srv->timers[i].state = TIMER_NONE;
+    rate_unlist(srv, i);
+    METRIC_ADD(srv->stats.disconnects, 1);
+    outq_clear(&srv->outq[i]);
+    slab_free(srv->inbuf[i].buf);
+    slab_free(srv->inbuf[i].held);
+    memset(&srv->inbuf[i], 0, sizeof(srv->inbuf[i]));
+    close(srv->clients[i]);
+    srv->clients[i] = 0;
+    room_leave_all(srv, i);
+    nick_clear(srv, i);
+    slot_free(srv, i);
+}
+
+// 把已接受的連線放入空槽並向 backend 註冊
+// 回傳 slot，-1 表示已拒絕並關閉
+static int add_client(struct server *srv, int cfd) {
+    // 從 free list 取一個空槽存放新的 client（select 只能監聽小於 FD_SETSIZE 的 fd）
+    int slot = -1;
+    if (srv->backend != BACKEND_SELECT || cfd < FD_SETSIZE) slot = slot_alloc(srv);
+    if (slot < 0) {
+        // 已達最大人數，拒絕連線
+        const char *msg = "Server full.\n";
+        send(cfd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(cfd);
+        METRIC_ADD(srv->stats.rejected, 1);
+        return -1;
+    }
+
+    // socket 在 accept 時就設定了 SOCK_NONBLOCK，send() 寫不下時留在輸出佇列
+    if (srv->backend == BACKEND_EPOLL) {
+        // edge-triggered 下 EPOLLOUT 只在 socket 由滿轉為可寫時通知，不需要反覆 EPOLL_CTL_MOD
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)slot;
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(cfd);
+            slot_free(srv, slot);
+            return -1;
+        }
+    }
+
+    // 接受新連線，預設名稱 anon<fd>，一開始使用文字協定
+    srv->clients[slot] = cfd;
+    srv->proto[slot]   = PROTO_TEXT;
+    // 預設名稱以 fd 編號組成，fd 在整個 process 內唯一，且 anon<數字> 不能被 NICK 取用，所以不會衝突
+    char anon[NAME_LEN];
+    snprintf(anon, sizeof(anon), "anon%d", cfd);
+    if (nick_set(srv, slot, anon) < 0) snprintf(srv->names[slot], NAME_LEN, "%s", anon);
+    printf("New client fd=%d at shard=%d slot=%d name=%s\n", cfd, srv->id, slot, srv->names[slot]);
+
+    if (srv->backend == BACKEND_URING) {
+        srv->ring->inflight[slot] = 0;
+        uring_prep_recv(srv, slot);
+    }
+    timer_start(srv, slot); // 最近的對話稍後才重播，見 client_greet()
+    rate_start(srv, slot);
+    METRIC_ADD(srv->stats.accepts, 1);
+    return slot;
+}
+
+// 把 listener 佇列裡的新連線全部接完（非阻塞 listener 回傳 EAGAIN 為止），回傳接受的連線數
+// 重連風暴時一次喚醒就接上整批 client，不會每條連線都要等一輪事件迴圈，佇列也不會滿到開始丟 SYN。
+// accept4 直接設定 SOCK_NONBLOCK | SOCK_CLOEXEC，每條連線省下兩次 fcntl
+// lfd 為 TCP 或 AF_UNIX 的 listener，兩者接受的 client 放進同一個表，廣播與頻道都一樣
+static int accept_clients(struct server *srv, int lfd) {
+    int n = 0;
+    for (;;) {
+        int cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+                METRIC_ADD(srv->stats.accept_errors, 1);
+            }
+            break;
+        }
+        add_client(srv, cfd);
+        n++;
+    }
+    if (n > 0) metric_observe(&srv->stats.accept_batch, (uint64_t)n, 1);
+    return n;
+}
+
+// 處理 server 端鍵盤輸入，回傳 0 表示要關閉 server
+static int handle_stdin(struct server *srv) {
+    char *buf = srv->buf;
+    if (!fgets(buf, BUF_SIZE, stdin)) {
+        // EOF（例如 Ctrl+D），直接關閉 server
+        printf("stdin EOF. shutting down.\n");
+        return 0;
+    }
+    trim_crlf(buf);
+    if (strcmp(buf, "/quit") == 0) return 0; // "/quit" 指令關閉 server
+    if (strcmp(buf, "/restart") == 0) return !restart_begin(); // 熱重啟，連線交給新的 process
+    if (strcmp(buf, "/rooms") == 0 || strcmp(buf, "/slab") == 0) {
+        // 每個 shard 各自印出自己的頻道或 slab 統計（其他 shard 經由 inbox 要求）
+        int rooms = buf[1] == 'r';
+        if (rooms) room_print_stats(srv);
+        else       slab_print_stats(srv);
+        for (int k = 0; k < nshards; k++) {
+            if (k != srv->id) inbox_post(&shards[k], NULL, rooms ? XMSG_ROOM_STATS : XMSG_SLAB_STATS, NULL);
+        }
+        return 1;
+    }
+
+    // 廣播訊息，格式為 [server] <msg>\n，只格式化一次
+    struct msgbuf *m = msg_line("server", buf, strlen(buf));
+    if (m) {
+        broadcast_to_all(srv, -1, m);
+        msg_unref(m);
+    }
+    return 1;
+}
+
+// 處理 "MSG <nick> <text>"（args 為 "MSG " 之後的部分）：以暱稱索引找到收件者，只送給他一個人
+// 收件者看到的格式為 "[寄件者 -> 收件者] text\n"
+static void send_private(struct server *srv, int i, char *args) {
+    char *text = strchr(args, ' ');
+    if (!text || text == args || text[1] == '\0') {
+        const char *msg = "Usage: MSG <nick> <text>\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    *text++ = '\0';
+
+    if (args[0] == '#') {
+        // 頻道訊息：必須是成員，格式為 "[#room 寄件者] text\n"
+        struct room *r = room_find(srv, args);
+        if (!r || room_ref_of(srv, i, r) < 0) {
+            const char *msg = "Not in that room\n";
+            send_to_client(srv, i, msg, strlen(msg));
+            return;
+        }
+        char from[2 * NAME_LEN + 2];
+        snprintf(from, sizeof(from), "%s %s", r->name, srv->names[i]);
+        printf("[%s] %s\n", from, text);
+        struct msgbuf *m = msg_line(from, text, strlen(text));
+        if (!m) return;
+        m->sender = (uint32_t)srv->clients[i];
+        m->flags  = FRAME_F_ROOM;
+        room_send(srv, r->name, i, m);
+        msg_unref(m);
+        return;
+    }
+
+    int shard, slot;
+    char to[NAME_LEN];
+    if (nick_lookup(args, &shard, &slot, to) < 0) {
+        char err[NAME_LEN + 32];
+        int n = snprintf(err, sizeof(err), "No such nick: %.*s\n", NAME_LEN - 1, args);
+        send_to_client(srv, i, err, (size_t)n);
+        return;
+    }
+
+    char from[2 * NAME_LEN + 8];
+    snprintf(from, sizeof(from), "%s -> %s", srv->names[i], to);
+    printf("[%s] %s\n", from, text);
+    struct msgbuf *m = msg_line(from, text, strlen(text));
+    if (!m) return;
+    m->sender = (uint32_t)srv->clients[i];
+    m->flags  = FRAME_F_PRIVATE;
+    if (shard == srv->id) deliver_local(srv, slot, to, m);
+    else                  inbox_post(&shards[shard], m, slot, to);
+    msg_unref(m);
+}
+
+// 設定 client i 的暱稱（NICK <name> 或 FRAME_NICK）
+static void set_nick(struct server *srv, int i, const char *newname) {
+    if (*newname == '\0') {
+        const char *msg = "Name cannot be empty\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    char clean[NAME_LEN];
+    int k = 0;
+    // 過濾掉非印字元與 '['、']'
+    for (; *newname && k < NAME_LEN - 1; newname++) {
+        if (isprint((unsigned char)*newname) && *newname != '[' && *newname != ']') {
+            clean[k++] = *newname;
+        }
+    }
+    clean[k] = '\0';
+    if (k == 0) {
+        const char *msg = "Invalid name\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    if (clean[0] == '#') {
+        const char *msg = "Invalid name\n"; // '#' 開頭的是頻道
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    if (nick_reserved(clean)) {
+        const char *msg = "Name is reserved\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    char old[NAME_LEN];
+    snprintf(old, sizeof(old), "%s", srv->names[i]);
+    if (nick_set(srv, i, clean) < 0) {
+        const char *msg = "Name already in use\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    printf("Client fd=%d set name: %s -> %s\n", srv->clients[i], old, clean);
+    if (srv->timers[i].state == TIMER_NICK) timer_arm(srv, i, TIMER_IDLE, idle_timeout);
+    // 改名不廣播
+}
+
+// 廣播一則聊天訊息（文字協定的一般行或 FRAME_MSG）
+static void send_chat(struct server *srv, int i, const char *text, size_t len) {
+    // 印在 server 終端，並廣播給其他 client
+    printf("[%s] %s\n", srv->names[i], text);
+
+    struct msgbuf *m = msg_line(srv->names[i], text, len); // 廣播格式 [name] msg\n
+    if (!m) return;
+    m->sender = (uint32_t)srv->clients[i];
+    broadcast_to_all(srv, i, m);
+    msg_unref(m);
+}
+
+// 處理 client i 傳來的一行（不含行尾字元，已補上 '\0'，長度為 len）
+static void handle_client_message(struct server *srv, int i, char *buf, size_t len) {
+    METRIC_ADD(srv->stats.msgs_in, 1);
+
+    // 協定：PROTO BIN [LZ4] -> 回覆同一行之後改用二進位 frame（chatframe.h），LZ4 表示要壓縮
+    if (strncmp(buf, "PROTO ", 6) == 0) {
+        int proto = strcmp(buf + 6, "BIN") == 0 ? PROTO_BIN : strcmp(buf + 6, "BIN LZ4") == 0 ? PROTO_LZ4 : -1;
+        if (proto < 0) {
+            const char *msg = "Unknown protocol\n";
+            send_to_client(srv, i, msg, strlen(msg));
+            return;
+        }
+        buf[len] = '\n';
+        send_to_client(srv, i, buf, len + 1); // 回覆本身還是文字
+        buf[len] = '\0';
+        srv->proto[i] = (unsigned char)proto;
+        client_greet(srv, i);
+        return;
+    }
+    client_greet(srv, i); // 第一行：先送連線時的歷史重播
+
+    // 協定：NICK <name> -> 設定暱稱
+    if (strncmp(buf, "NICK ", 5) == 0) {
+        set_nick(srv, i, buf + 5);
+        return;
+    }
+
+    // 協定：MSG <nick> <text> -> 私訊；MSG #room <text> -> 頻道訊息
+    if (strncmp(buf, "MSG ", 4) == 0) {
+        send_private(srv, i, buf + 4);
+        return;
+    }
+
+    // 協定：PING <token> -> 回 PONG <token>；PONG 只用來證明連線還活著（收到資料時已記錄）
+    if (strncmp(buf, "PING", 4) == 0 && (buf[4] == ' ' || buf[4] == '\0')) {
+        char pong[BUF_SIZE + 8];
+        int n = snprintf(pong, sizeof(pong), "PONG%s\n", buf + 4);
+        send_to_client(srv, i, pong, (size_t)n);
+        return;
+    }
+    if (strncmp(buf, "PONG", 4) == 0 && (buf[4] == ' ' || buf[4] == '\0')) return;
+
+    // 協定：HISTORY [n] -> 重播最近 n 則（預設全部）廣播
+    if (strcmp(buf, "HISTORY") == 0 || strncmp(buf, "HISTORY ", 8) == 0) {
+        int n = buf[7] ? atoi(buf + 8) : (int)history_len;
+        if (n > 0) recent_replay(srv, i, (unsigned)n);
+        return;
+    }
+
+    // 協定：JOIN #room / PART #room -> 加入、離開頻道
+    if (strncmp(buf, "JOIN ", 5) == 0) {
+        room_join(srv, i, buf + 5);
+        return;
+    }
+    if (strncmp(buf, "PART ", 5) == 0) {
+        room_part(srv, i, buf + 5);
+        return;
+    }
+
+    // 一般訊息
+    send_chat(srv, i, buf, len);
+}
+
+// 處理 client i 傳來的一個 frame（f 指向標頭，n 為整個 frame 的長度）
+// 依標頭的種類分派，不需要比對指令字串；payload 後面暫時補上 '\0' 給字串處理用
+static void handle_client_frame(struct server *srv, int i, char *f, size_t n) {
+    char *payload = f + FRAME_HDR;
+    size_t len = n - FRAME_HDR;
+    char saved = payload[len];
+    METRIC_ADD(srv->stats.msgs_in, 1);
+
+    // 其他 client 可能使用文字協定，內容不能夾帶換行（唯一需要看 payload 的地方，以 SIMD 掃描）
+    if (scan_eol(payload, len)) {
+        const char *msg = "Invalid frame\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        return;
+    }
+    payload[len] = '\0';
+
+    switch (frame_type(f)) {
+    case FRAME_MSG:
+        if (len > 0) send_chat(srv, i, payload, len);
+        break;
+    case FRAME_NICK:
+        set_nick(srv, i, payload);
+        break;
+    case FRAME_PRIV:
+        send_private(srv, i, payload);
+        break;
+    case FRAME_JOIN:
+        room_join(srv, i, payload);
+        break;
+    case FRAME_PART:
+        room_part(srv, i, payload);
+        break;
+    case FRAME_HISTORY: {
+        int cnt = len ? atoi(payload) : (int)history_len;
+        if (cnt > 0) recent_replay(srv, i, (unsigned)cnt);
+        break;
+    }
+    case FRAME_PING: {
+        struct msgbuf *m = msg_alloc(n);
+        if (!m) break;
+        memcpy(m->data, f, n);
+        frame_put(m->data, FRAME_PONG, 0, len, 0);
+        m->len = n;
+        send_frame(srv, i, m);
+        msg_unref(m);
+        break;
+    }
+    case FRAME_PONG:
+        break; // 收到資料時已記錄
+    default: {
+        const char *msg = "Unknown frame type\n";
+        send_to_client(srv, i, msg, strlen(msg));
+        break;
+    }
+    }
+    if (srv->clients[i] > 0) payload[len] = saved;
+}
+
+// client 送來的標頭是否錯亂：type 0 不存在，client 也不可以送壓縮的 frame
+static int frame_hdr_bad(const char *f) {
+    return frame_type(f) == 0 || (frame_flags(f) & FRAME_F_LZ4);
+}
+
+// 這個 frame 這次要處理的 payload 長度：超過 FRAME_CLIENT_MAX 的 frame 分段處理
+static size_t frame_chunk(const char *f) {
+    size_t len = frame_len(f);
+    return len < FRAME_CLIENT_MAX ? len : FRAME_CLIENT_MAX;
+}
+
+// 速率限制：要丟掉的部分不計
+static int frame_take(struct server *srv, int i, const char *f) {
+    return (frame_flags(f) & FRAME_F_SKIP) || rate_take(srv, i, frame_chunk(f));
+}
+
+// 處理 f 開頭的一段 frame（標頭之後已有 frame_chunk(f) bytes），回傳下一個 frame 的位移。
+// 過長的 frame 處理完第一段後，把剩下部分的標頭寫在這一段的最後 FRAME_HDR bytes（已經用不到），
+// 回傳的位置就是這個新標頭：FRAME_MSG 接著當成下一則訊息（和文字協定切開過長的行一樣），
+// 其他種類標上 FRAME_F_SKIP，剩下的部分直接丟掉
+static size_t frame_consume(struct server *srv, int i, char *f) {
+    size_t len = frame_len(f), chunk = frame_chunk(f);
+    unsigned type = frame_type(f), flags = frame_flags(f);
+    if (!(flags & FRAME_F_SKIP)) handle_client_frame(srv, i, f, FRAME_HDR + chunk);
+    if (len == chunk) return FRAME_HDR + len;
+    frame_put(f + chunk, type, type == FRAME_MSG ? 0 : flags | FRAME_F_SKIP, len - chunk, 0);
+    return chunk;
+}
+
+// 二進位協定：依標頭的長度切出 frame，不掃描內容
+// 資料的要求與 feed_client 相同（data[n] 可寫）；不完整的 frame 存進 inbuf 等下次。
+// 重組 buffer 最多只存一段 (FRAME_HDR + FRAME_CLIENT_MAX)，過長的 frame 由 frame_consume 分段
+static void feed_frames(struct server *srv, int i, char *data, size_t n) {
+    struct linebuf *lb = &srv->inbuf[i];
+    char *p = data, *end = data + n;
+
+    // 先補完上次留下的半個 frame：標頭收齊才知道還要多少
+    while (lb->len > 0) {
+        size_t take;
+        if (lb->len < FRAME_HDR) {
+            take = FRAME_HDR - lb->len;
+            if (take > (size_t)(end - p)) take = (size_t)(end - p);
+            memcpy(lb->buf + lb->len, p, take);
+            lb->len += take;
+            p += take;
+            if (lb->len < FRAME_HDR) return;
+            if (frame_hdr_bad(lb->buf)) goto bad;
+        }
+        size_t need = FRAME_HDR + frame_chunk(lb->buf);
+        take = need - lb->len;
+        if (take > (size_t)(end - p)) take = (size_t)(end - p);
+        memcpy(lb->buf + lb->len, p, take);
+        lb->len += take;
+        p += take;
+        if (lb->len < need) return;
+        if (!frame_take(srv, i, lb->buf)) {
+            lb->len -= take;
+            p -= take;
+            rate_hold(srv, i, p, (size_t)(end - p));
+            rate_pause(srv, i);
+            return;
+        }
+        size_t used = frame_consume(srv, i, lb->buf);
+        if (srv->clients[i] == 0) return;
+        if (used < need) {             // 過長的 frame：留下剩下部分的標頭
+            memmove(lb->buf, lb->buf + used, FRAME_HDR);
+            lb->len = FRAME_HDR;
+        } else {
+            lb->len = 0;
+        }
+    }
+
+    while (p < end) {
+        size_t rest = (size_t)(end - p);
+        if (rest >= FRAME_HDR && frame_hdr_bad(p)) goto bad;
+        if (rest < FRAME_HDR || rest < FRAME_HDR + frame_chunk(p)) {
+            // 半個 frame：留到下次 recv
+            if (!lb->buf && !(lb->buf = slab_alloc(BUF_SIZE))) return;
+            memcpy(lb->buf, p, rest);
+            lb->len = rest;
+            return;
+        }
+        if (!frame_take(srv, i, p)) {
+            rate_hold(srv, i, p, rest);
+            rate_pause(srv, i);
+            return;
+        }
+        size_t used = frame_consume(srv, i, p);
+        if (srv->clients[i] == 0) return;
+        p += used;
+    }
+    return;
+
+bad:
+    printf("Client %s (fd=%d) sent a malformed frame header, disconnecting.\n", srv->names[i], srv->clients[i]);
+    drop_client(srv, i);
+}
+
+// 把 client i 這次 recv 到的資料切成行，逐行交給 handle_client_message
+// '\r' 與 '\n' 都視為行尾（"\r\n" 因此會多出一個空行），空行直接略過
+// data 會被就地修改（把行尾字元換成 '\0'），呼叫者必須保證 data[n] 可寫；
+// 不完整的最後一行存進 inbuf 等下次
+static void feed_client(struct server *srv, int i, char *data, size_t n) {
+    struct linebuf *lb = &srv->inbuf[i];
+    char *p = data, *end = data + n;
+
+    srv->timers[i].last_rx = srv->wheel.now;
+    rate_refill(&srv->rate[i], srv->now_ms);
+    if (srv->rate[i].pause_pos >= 0) { // 暫停中（io_uring 取消 recv 前已收到的資料）：全部存起來
+        rate_hold(srv, i, p, n);
+        return;
+    }
+    if (srv->proto[i]) {
+        feed_frames(srv, i, data, n);
+        return;
+    }
+
+    // 先補完上次留下的半行
+    if (lb->len > 0) {
+        const char *eol = scan_eol(p, (size_t)(end - p));
+        size_t take = eol ? (size_t)(eol - p) : (size_t)(end - p);
+        int done = eol != NULL;
+        if (lb->len + take > BUF_SIZE - 1) { // 太長，先把已收的部分當成一行
+            take = BUF_SIZE - 1 - lb->len;
+            done = 1;
+        }
+        memcpy(lb->buf + lb->len, p, take);
+        lb->len += take;
+        p += take;
+        if (!done) return;
+        if (!rate_take(srv, i, lb->len)) {
+            // 額度用完：剛補完的這一行留在 lb，後面的資料存起來
+            lb->len -= take;
+            p -= take;
+            rate_hold(srv, i, p, (size_t)(end - p));
+            rate_pause(srv, i);
+            return;
+        }
+        if (p == eol) p++; // 跳過行尾字元
+        size_t len = lb->len;
+        lb->buf[len] = '\0';
+        lb->len = 0;
+        handle_client_message(srv, i, lb->buf, len);
+        if (srv->clients[i] == 0) return; // 處理過程中已被移除
+        if (srv->proto[i]) {             // PROTO BIN：後面的資料都是 frame
+            feed_frames(srv, i, p, (size_t)(end - p));
+            return;
+        }
+    }
+
+    while (p < end) {
+        const char *eol = scan_eol(p, (size_t)(end - p));
+        if (!eol) {
+            size_t rest = (size_t)(end - p);
+            if (rest < BUF_SIZE - 1) {
+                // 半行：留到下次 recv
+                if (!lb->buf && !(lb->buf = slab_alloc(BUF_SIZE))) return;
+                memcpy(lb->buf, p, rest);
+                lb->len = rest;
+                return;
+            }
+            eol = end; // 一整個 buffer 都沒有行尾，直接當成一行
+        }
+        char *e = p + (eol - p);
+        size_t len = (size_t)(e - p);
+        if (len > 0 && !rate_take(srv, i, len)) {
+            // 額度用完：從這一行開始的資料存起來，恢復後再處理
+            rate_hold(srv, i, p, (size_t)(end - p));
+            rate_pause(srv, i);
+            return;
+        }
+        *e = '\0';
+        p = e + 1;
+        if (len > 0) {
+            handle_client_message(srv, i, e - len, len);
+            if (srv->clients[i] == 0) return;
+            if (srv->proto[i]) {
+                if (p < end) feed_frames(srv, i, p, (size_t)(end - p));
+                return;
+            }
+        }
+    }
+}
+
+// client i 可讀：select 模式收一次；epoll (edge-triggered) 模式要讀到 EAGAIN 為止
+static void handle_client_readable(struct server *srv, int i) {
+    for (;;) {
+        int n = recv(srv->clients[i], srv->buf, BUF_SIZE - 1, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // client 離線或錯誤
+            drop_client(srv, i);
+            return;
+        }
+        METRIC_ADD(srv->stats.bytes_in, (uint64_t)n);
+        feed_client(srv, i, srv->buf, (size_t)n);
+        if (rate_check(srv, i)) return;   // 超過速率，剩下的留在 socket buffer
+        if (srv->backend == BACKEND_SELECT) return;
+        if (srv->clients[i] == 0) return; // 處理過程中已被移除
+    }
+}
+
+// select() 版本的事件迴圈：每次都重建 fd_set 並掃描所有 slot
+static void run_select_loop(struct server *srv) {
+    fd_set readfds, writefds;
+    int maxfd;
+
+    for (;;) {
+        // 每次迴圈都要重設 fd_set
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(srv->listen_fd, &readfds); // 監聽新連線
+        FD_SET(srv->inbox.efd, &readfds); // 其他 shard 轉送的訊息
+        if (srv->id == 0) FD_SET(STDIN_FILENO, &readfds); // 監聽鍵盤輸入
+        maxfd = srv->listen_fd > srv->inbox.efd ? srv->listen_fd : srv->inbox.efd;
+        if (srv->unix_fd >= 0) {
+            FD_SET(srv->unix_fd, &readfds); // 本機的 AF_UNIX 連線
+            if (srv->unix_fd > maxfd) maxfd = srv->unix_fd;
+        }
+
+        // 把所有 client socket 加入監聽集合；輸出佇列還有資料的也要等可寫
+        for (int i = 0; i < srv->nslots; i++) {
+            if (srv->clients[i] > 0) {
+                if (srv->rate[i].pause_pos < 0) FD_SET(srv->clients[i], &readfds);
+                if (srv->outq[i].count > 0) FD_SET(srv->clients[i], &writefds);
+                if (srv->clients[i] > maxfd) maxfd = srv->clients[i];
+            }
+        }
+
+        // 使用 select 等待事件（新連線 / 有資料可讀 / 可寫），最多等到下一個計時器到期
+        int ms = loop_timeout_ms(srv);
+        struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+        int nready = select(maxfd + 1, &readfds, &writefds, NULL, ms >= 0 ? &tv : NULL);
+        if (nready < 0) {
+            if (errno == EINTR) continue; // 如果被 signal 中斷則重試
+            perror("select");
+            return;
+        }
+        timers_run(srv);
+        rate_resume_due(srv);
+
+        // --- 1. 處理新 client 連線 ---
+        if (FD_ISSET(srv->listen_fd, &readfds)) accept_clients(srv, srv->listen_fd);
+        if (srv->unix_fd >= 0 && FD_ISSET(srv->unix_fd, &readfds)) accept_clients(srv, srv->unix_fd);
+
+        // --- 2. 處理 server 端輸入與其他 shard 的訊息 ---
+        if (srv->id == 0 && FD_ISSET(STDIN_FILENO, &readfds)) {
+            if (!handle_stdin(srv)) return;
+        }
+        if (FD_ISSET(srv->inbox.efd, &readfds)) {
+            if (!drain_inbox(srv)) return;
+        }
+
+        // --- 3. 處理 client 傳來的資料 ---
+        for (int i = 0; i < srv->nslots; i++) {
+            int sd = srv->clients[i];
+            if (sd <= 0) continue;
+            if (FD_ISSET(sd, &writefds) && flush_client(srv, i) < 0) continue;
+            if (!FD_ISSET(sd, &readfds)) continue;
+            handle_client_readable(srv, i);
+        }
+
+        // --- 4. 送出這個 tick 累積的輸出 ---
+        flush_dirty(srv);
+    }
+}
+
+// epoll 版本的事件迴圈：fd 只在連線/斷線時註冊一次，喚醒成本只和活躍的 socket 數量有關
+static void run_epoll_loop(struct server *srv) {
+    struct epoll_event evs[MAX_EVENTS];
+
+    for (;;) {
+        int nready = epoll_wait(srv->epfd, evs, MAX_EVENTS, loop_timeout_ms(srv));
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return;
+        }
+        timers_run(srv);
+        rate_resume_due(srv);
+
+        for (int k = 0; k < nready; k++) {
+            uint32_t tag = evs[k].data.u32;
+            if (tag == TAG_LISTEN) {
+                // edge-triggered：把 backlog 裡的連線全部接完
+                accept_clients(srv, srv->listen_fd);
+            } else if (tag == TAG_UNIX) {
+                accept_clients(srv, srv->unix_fd);
+            } else if (tag == TAG_STDIN) {
+                if (!handle_stdin(srv)) return;
+            } else if (tag == TAG_INBOX) {
+                if (!drain_inbox(srv)) return;
+            } else if (srv->clients[tag] > 0) {
+                uint32_t e = evs[k].events;
+                if ((e & EPOLLOUT) && flush_client(srv, (int)tag) < 0) continue;
+                if ((e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && srv->rate[tag].pause_pos < 0)
+                    handle_client_readable(srv, (int)tag);
+            }
+        }
+        flush_dirty(srv);
+    }
+}
+
+// 建立 epoll fd 並註冊 listener 與 stdin，失敗回傳 -1
+static int setup_epoll(struct server *srv) {
+    srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epfd < 0) { perror("epoll_create1"); return -1; }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.u32 = TAG_LISTEN;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(srv->epfd);
+        srv->epfd = -1;
+        return -1;
+    }
+    ev.data.u32 = TAG_UNIX;
+    if (srv->unix_fd >= 0 && epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->unix_fd, &ev) < 0) {
+        perror("epoll_ctl(unix)");
+        close(srv->epfd);
+        srv->epfd = -1;
+        return -1;
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.u32 = TAG_INBOX;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->inbox.efd, &ev) < 0) {
+        perror("epoll_ctl(inbox)");
+        close(srv->epfd);
+        srv->epfd = -1;
+        return -1;
+    }
+
+    // stdin 由 fgets() 帶緩衝讀取，所以用 level-triggered
+    // 若 stdin 是一般檔案（epoll 不支援），就不監聽鍵盤輸入
+    ev.events   = EPOLLIN;
+    ev.data.u32 = TAG_STDIN;
+    if (srv->id == 0 && epoll_ctl(srv->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0 && errno != EPERM) {
+        perror("epoll_ctl(stdin)");
+    }
+    return 0;
+}
+
+// 釋放 io_uring 相關資源（SQE 區、ring、provided buffers）
+static void uring_free(struct uring *r) {
+    if (!r) return;
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->ring_ptr && r->ring_ptr != MAP_FAILED) munmap(r->ring_ptr, r->ring_len);
+    if (r->br && r->br != MAP_FAILED) munmap(r->br, r->br_len);
+    if (r->fd >= 0) close(r->fd);
+    free(r->bufs);
+    free(r->gen);
+    free(r->inflight);
+    free(r);
+}
+
+// 建立 io_uring、註冊 provided buffer ring，並送出 accept 與 stdin 的 SQE；失敗回傳 -1
+static int setup_uring(struct server *srv) {
+    struct uring *r = calloc(1, sizeof(*r));
+    if (!r) return -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_SIZE;
+    r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0) { perror("io_uring_setup"); goto fail; }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring: kernel lacks IORING_FEAT_SINGLE_MMAP\n");
+        goto fail;
+    }
+    r->ext_arg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    if (!r->ext_arg && (idle_timeout > 0 || nick_timeout > 0))
+        fprintf(stderr, "io_uring: kernel lacks IORING_FEAT_EXT_ARG, timers only run when other events arrive\n");
+
+    // SQ 與 CQ ring 共用同一塊 mmap
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->ring_ptr = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING);
+    if (r->ring_ptr == MAP_FAILED) { perror("mmap(sq ring)"); goto fail; }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { perror("mmap(sqes)"); goto fail; }
+
+    char *base = r->ring_ptr;
+    r->sq_head    = (unsigned *)(base + p.sq_off.head);
+    r->sq_tail    = (unsigned *)(base + p.sq_off.tail);
+    r->sq_mask    = (unsigned *)(base + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head    = (unsigned *)(base + p.cq_off.head);
+    r->cq_tail    = (unsigned *)(base + p.cq_off.tail);
+    r->cq_mask    = (unsigned *)(base + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    // SQ array 固定為 index i -> SQE i，之後送出時只需要推進 tail
+    unsigned *array = (unsigned *)(base + p.sq_off.array);
+    for (unsigned k = 0; k < p.sq_entries; k++) array[k] = k;
+    r->sq_local_tail = r->sq_submitted = *r->sq_tail;
+
+    // provided buffer ring：multishot recv 由 kernel 自行挑選 buffer
+    r->br_len = URING_NBUFS * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) { perror("mmap(buf ring)"); goto fail; }
+    r->bufs = malloc((size_t)URING_NBUFS * BUF_SIZE);
+    if (!r->bufs) goto fail;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid         = URING_BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(PBUF_RING)");
+        goto fail;
+    }
+    for (unsigned bid = 0; bid < URING_NBUFS; bid++) uring_recycle_buf(r, bid);
+
+    srv->ring = r;
+    uring_prep_accept(srv, UOP_ACCEPT);
+    if (srv->unix_fd >= 0) uring_prep_accept(srv, UOP_ACCEPT_UNIX);
+    uring_prep_poll(srv, srv->inbox.efd, UOP_INBOX);
+    if (srv->id == 0) uring_prep_poll(srv, STDIN_FILENO, UOP_STDIN);
+    if (uring_submit(r, 0, -1) < 0) {
+        perror("io_uring_enter");
+        srv->ring = NULL;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    uring_free(r);
+    return -1;
+}
+
+// 被取消、只送出一部分或取不到 SQE 的 SENDMSG：沒送出的部分放回輸出佇列最前面（交接時連同佇列交給新的 process）
+// 第一則可能已送出一部分，以 head_off 記住位置
+static void uring_send_requeue(struct server *srv, struct uring_send *op) {
+    struct outq *q = &srv->outq[op->slot];
+    for (int k = op->nmsg - 1; k >= op->first; k--) {
+        if (outq_unshift(q, op->msgs[k]) < 0) return;
+        op->msgs[k] = NULL;            // 參考交給佇列
+    }
+    if (op->first < op->nmsg) {
+        q->head_off = (size_t)((char *)op->iov[op->first].iov_base - outq_at(q, 0)->data);
+        q->bytes   -= q->head_off;
+    }
+}
+
+// SENDMSG 完成：部分完成就把剩下的 iovec 再送一次，否則讓這個 client 可以送下一批
+static void uring_send_done(struct server *srv, struct uring_send *op, int res) {
+    struct uring *r = srv->ring;
+    int i = op->slot;
+    int live = srv->clients[i] > 0 && r->gen[i] == op->gen;
+    if (live && res > 0) {
+        size_t done = (size_t)res;
+        METRIC_ADD(srv->stats.bytes_out, done);
+        while (op->first < op->nmsg && done >= op->iov[op->first].iov_len) {
+            done -= op->iov[op->first].iov_len;
+            op->first++;
+            METRIC_ADD(srv->stats.msgs_out, 1);
+        }
+        if (op->first < op->nmsg) {
+            op->iov[op->first].iov_base = (char *)op->iov[op->first].iov_base + done;
+            op->iov[op->first].iov_len -= done;
+            if (!srv->handoff && uring_prep_send(srv, op) == 0) return;
+            uring_send_requeue(srv, op); // 交接中或取不到 SQE：剩下的部分放回佇列
+        }
+    } else if (live && srv->handoff) {
+        uring_send_requeue(srv, op);
+    }
+    // 送出失敗時不在這裡斷線，client 的 recv 會收到 EOF/錯誤再統一處理
+    if (live) {
+        r->inflight[i] = 0;
+        if (srv->outq[i].count > 0) mark_dirty(srv, i);
+    }
+    uring_send_free(op);
+}
+
+// multishot recv 的完成事件：處理資料並歸還 buffer，必要時重新提交 recv
+static void uring_recv_done(struct server *srv, const struct io_uring_cqe *cqe) {
+    struct uring *r = srv->ring;
+    int slot     = (int)((cqe->user_data >> 8) & 0xFFFFFF);
+    uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+    int live     = srv->clients[slot] > 0 && r->gen[slot] == gen;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (live && cqe->res > 0) {
+            char *data = r->bufs + (size_t)bid * BUF_SIZE;
+            METRIC_ADD(srv->stats.bytes_in, (uint64_t)cqe->res);
+            feed_client(srv, slot, data, (size_t)cqe->res);
+        }
+        uring_recycle_buf(r, bid); // 過期的完成事件也一定要把 buffer 還回去
+    }
+    if (!live || srv->clients[slot] == 0) return;
+
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        // client 離線或錯誤
+        drop_client(srv, slot);
+        return;
+    }
+    // 超過速率：取消 recv（已經收進來的完成事件照常處理，token 會變成負的，暫停得更久）
+    rate_check(srv, slot);
+    // buffer 用盡 (ENOBUFS)、被速率限制取消，或 kernel 結束了 multishot：沒有暫停就重新提交
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (srv->rate[slot].reads_off) srv->rate[slot].recv_off = 1;
+        else                                uring_prep_recv(srv, slot);
+    }
+}
+
+// 處理一個完成事件，回傳 0 表示要關閉 server
+static int uring_handle_cqe(struct server *srv, const struct io_uring_cqe *cqe) {
+    uint64_t ud = cqe->user_data;
+    if ((ud & 0xF) == 0) {
+        uring_send_done(srv, (struct uring_send *)(uintptr_t)ud, cqe->res);
+        return 1;
+    }
+    switch (ud & 0xFF) {
+    case UOP_ACCEPT:
+    case UOP_ACCEPT_UNIX:
+        if (cqe->res >= 0) {
+            add_client(srv, cqe->res);
+            srv->accepted++;
+        } else if (cqe->res == -EINVAL) {
+            fprintf(stderr, "io_uring: multishot accept not supported\n");
+            return 0;
+        } else {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+            METRIC_ADD(srv->stats.accept_errors, 1);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) uring_prep_accept(srv, (int)(ud & 0xFF));
+        return 1;
+    case UOP_RECV:
+        uring_recv_done(srv, cqe);
+        return 1;
+    case UOP_STDIN:
+        if (!handle_stdin(srv)) return 0;
+        uring_prep_poll(srv, STDIN_FILENO, UOP_STDIN);
+        return 1;
+    case UOP_INBOX:
+        if (!drain_inbox(srv)) return 0;
+        uring_prep_poll(srv, srv->inbox.efd, UOP_INBOX);
+        return 1;
+    }
+    return 1;
+}
+
+// io_uring 版本的事件迴圈
+// 每個 tick：把累積的 SENDMSG 與重新提交的 recv 一起交給 kernel，同一次 io_uring_enter 等待完成事件，
+// 再一次處理所有 CQE。廣播給 N 個 client 只需要 N 個 SQE 與一次 syscall。
+static void run_uring_loop(struct server *srv) {
+    struct uring *r = srv->ring;
+
+    for (;;) {
+        flush_dirty(srv);
+        if (uring_submit(r, 1, loop_timeout_ms(srv)) < 0) {
+            perror("io_uring_enter");
+            return;
+        }
+        timers_run(srv);
+        rate_resume_due(srv);
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            if (!uring_handle_cqe(srv, &cqe)) {
+                __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (srv->accepted > 0) {
+            metric_observe(&srv->stats.accept_batch, (uint64_t)srv->accepted, 1);
+            srv->accepted = 0;
+        }
+    }
+}
+
+// 取消 user_data 為 target（或 fd 上所有操作，fd >= 0 時）的請求；完成事件為 UOP_DRAIN
+static int uring_prep_drain(struct uring *r, uint64_t target, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) return 0;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd     = fd;
+    if (fd >= 0) sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    else         sqe->addr = target;
+    sqe->user_data = UOP_DRAIN;
+    return 1;
+}
+
+// 熱重啟前讓 io_uring 靜止：取消 accept、每個 client 的 recv 與送出中的 SENDMSG，處理完所有完成事件
+// （已經收進來的資料照常處理，沒送出的部分放回輸出佇列），之後 client 的狀態就全部在佇列與
+// 重組 buffer 裡，可以交給新的 process。stdin 與 inbox 的完成事件不再處理
+static void uring_quiesce(struct server *srv) {
+    struct uring *r = srv->ring;
+    int pending = 0;
+    srv->handoff = 1;
+    pending += uring_prep_drain(r, UOP_ACCEPT, -1);
+    if (srv->unix_fd >= 0) pending += uring_prep_drain(r, UOP_ACCEPT_UNIX, -1);
+    for (int i = 0; i < srv->nslots; i++) {
+        if (srv->clients[i] > 0) pending += uring_prep_drain(r, 0, srv->clients[i]);
+    }
+
+    uint64_t deadline = mono_ms() + HANDOFF_DRAIN_MS;
+    for (int last = 0; ; ) {
+        int busy = pending > 0;
+        for (int i = 0; i < srv->nslots && !busy; i++) busy = srv->clients[i] > 0 && r->inflight[i];
+        uint64_t now = mono_ms();
+        if (!busy || now >= deadline) {
+            // 被取消的請求可能在取消的完成事件之後才產生自己的完成事件，再收一次
+            if (last++) break;
+            if (uring_submit(r, 0, -1) < 0) break;
+        } else if (uring_submit(r, 1, (int)(deadline - now)) < 0) {
+            break;
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            uint64_t ud = cqe.user_data;
+            if ((ud & 0xF) == 0)                            uring_send_done(srv, (struct uring_send *)(uintptr_t)ud, cqe.res);
+            else if ((ud & 0xFF) == UOP_RECV)               uring_recv_done(srv, &cqe);
+            else if (((ud & 0xFF) == UOP_ACCEPT || (ud & 0xFF) == UOP_ACCEPT_UNIX) && cqe.res >= 0)
+                add_client(srv, cqe.res);
+            else if ((ud & 0xFF) == UOP_DRAIN)              pending--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    int stuck = pending > 0;
+    for (int i = 0; i < srv->nslots; i++) stuck |= srv->clients[i] > 0 && r->inflight[i];
+    if (stuck) fprintf(stderr, "shard %d: io_uring did not quiesce in %d ms\n", srv->id, HANDOFF_DRAIN_MS);
+}
+
+// 建立 listening socket；多個 shard 時以 SO_REUSEPORT 讓每個 shard 各自 bind 同一個 port，
+// 由 kernel 把新連線分散到各 shard。只有一個 shard 時不設定：不小心再啟動一個 server 會 bind 失敗，
+// 而不是兩個互不相通的聊天室平分新連線。熱重啟接手的 process 也會設定，-t 變大時新的 shard
+// 才能和交接過來的 listener 一起 bind（舊的 listener 沒有 SO_REUSEPORT 時由 main 改用較少的 shard）。
+// 失敗回傳 -1
+static int create_listener(int port, int reuseport) {
+    // 建立 TCP socket；非阻塞，accept_clients 才能一直接到 EAGAIN
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) { perror("socket"); return -1; }
+
+    // 設定 SO_REUSEADDR，避免 server 重啟時 bind 失敗
+    int yes = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(server_fd);
+        return -1;
+    }
+
+    // 設定 server 端地址結構
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;           // IPv4
+    addr.sin_addr.s_addr = htonl(INADDR_ANY); // 接收所有網卡
+    addr.sin_port        = htons(port);       // 監聽的 port
+
+    // 綁定 socket 到指定 port
+    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(server_fd);
+        return -1;
+    }
+    // 開始監聽；backlog 要放得下重連風暴時一次湧進來的連線
+    if (listen(server_fd, listen_backlog) < 0) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// 建立 AF_UNIX listener：path 以 '@' 開頭時使用 abstract namespace（不會在檔案系統留下檔案），
+// 否則先移除上次留下的 socket 檔（只移除 socket，不會刪掉同名的一般檔案）。失敗回傳 -1
+static int create_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t n = strlen(path);
+    if (n < 2 && path[0] == '@') n = sizeof(addr.sun_path); // 只有 "@" 不是合法的名稱
+    if (n >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: invalid unix socket path\n", path);
+        return -1;
+    }
+    memcpy(addr.sun_path, path, n);
+    // abstract namespace 的名稱長度由位址長度決定，不含結尾的 '\0'
+    socklen_t alen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + (path[0] != '@'));
+    struct stat st;
+    if (path[0] == '@')                                      addr.sun_path[0] = '\0';
+    else if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket(AF_UNIX)"); return -1; }
+    if (bind(fd, (struct sockaddr *)&addr, alen) < 0 || listen(fd, listen_backlog) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 初始化一個 shard：listener（熱重啟時沿用舊 process 交過來的 listen_fd / unix_fd，否則為 -1）、
+// inbox 與事件迴圈 backend，失敗回傳 -1。AF_UNIX listener 只開在 shard 0
+static int shard_init(struct server *srv, int id, int port, enum backend backend, int listen_fd, int unix_fd) {
+    srv->id      = id;
+    srv->backend = backend;
+    srv->epfd    = -1;
+    wheel_init(&srv->wheel);
+    pthread_mutex_init(&srv->inbox.lock, NULL);
+    srv->inbox.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (srv->inbox.efd < 0) { perror("eventfd"); return -1; }
+
+    srv->listen_fd = listen_fd >= 0 ? listen_fd : create_listener(port, nshards > 1 || handed_off);
+    if (srv->listen_fd < 0) return -1;
+    if (listen_fd >= 0) {
+        // 交接過來的 listener 可能來自舊版本（阻塞模式）；再 listen 一次套用這次的 -L
+        set_nonblocking(listen_fd);
+        listen(listen_fd, listen_backlog);
+    }
+    if (id == 0 && unix_path) {
+        srv->unix_fd = unix_fd >= 0 ? unix_fd : create_unix_listener(unix_path);
+        if (srv->unix_fd < 0) return -1;
+    }
+
+    if (hist_dir && !(srv->hist = hist_open(id))) return -1;
+    if (history_len && !(srv->recent = calloc(history_len, sizeof(*srv->recent)))) {
+        perror("calloc");
+        return -1;
+    }
+
+    // io_uring 建立失敗時退回 epoll，epoll 建立失敗時退回 select
+    if (srv->backend == BACKEND_URING && setup_uring(srv) < 0) {
+        fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+        srv->backend = BACKEND_EPOLL;
+    }
+    if (srv->backend == BACKEND_EPOLL && setup_epoll(srv) < 0) {
+        fprintf(stderr, "epoll unavailable, falling back to select()\n");
+        srv->backend = BACKEND_SELECT;
+    }
+    return 0;
+}
+
+// 執行一個 shard 的事件迴圈；shard 0 結束時通知其他 shard 一起結束，熱重啟時 io_uring 先靜止下來
+static void *shard_main(void *arg) {
+    struct server *srv = arg;
+    slab_self = &srv->slab;
+    if (srv->backend == BACKEND_EPOLL)      run_epoll_loop(srv);
+    else if (srv->backend == BACKEND_URING) run_uring_loop(srv);
+    else                                    run_select_loop(srv);
+
+    if (srv->id == 0) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        for (int k = 1; k < nshards; k++) inbox_wake(&shards[k]);
+    }
+    if (restarting && srv->ring) uring_quiesce(srv);
+    return NULL;
+}
+
+// 關閉 shard 的所有 client 與 listener，並清掉 inbox 中尚未處理的訊息
+static void shard_close(struct server *srv) {
+    for (int i = 0; i < srv->nslots; i++) {
+        if (srv->clients[i] > 0) close(srv->clients[i]);
+        outq_clear(&srv->outq[i]);
+        slab_free(srv->inbuf[i].buf);
+        slab_free(srv->inbuf[i].held);
+    }
+    free(srv->freelist);
+    free(srv->clients);
+    free(srv->names);
+    free(srv->proto);
+    free(srv->outq);
+    free(srv->inbuf);
+    free(srv->dirty_mark);
+    free(srv->dirty);
+    for (int i = 0; i < srv->nslots; i++) slab_free(srv->joined[i].refs);
+    free(srv->joined);
+    free(srv->timers);
+    free(srv->rate);
+    free(srv->paused);
+    for (int k = 0; k < srv->nrooms; k++) {
+        free(srv->rooms[k]->members);
+        free(srv->rooms[k]);
+    }
+    free(srv->rooms);
+    free(srv->room_index.tab);
+    if (srv->recent) {
+        for (unsigned k = 0; k < history_len; k++) msg_unref(srv->recent[k]);
+        free(srv->recent);
+        msg_unref(srv->replay_z);
+    }
+    if (srv->hist) {
+        printf("shard %d history: %llu records, last segment shard%d-%08u.log\n", srv->id,
+               (unsigned long long)srv->hist->records, srv->id, srv->hist->seq);
+        hist_close(srv->hist);
+    }
+    if (srv->epfd >= 0) close(srv->epfd);
+    uring_free(srv->ring);
+    if (srv->listen_fd >= 0) close(srv->listen_fd);
+    if (srv->unix_fd >= 0) {
+        close(srv->unix_fd);
+        if (unix_path[0] != '@') unlink(unix_path);
+    }
+    struct xmsg *m = srv->inbox.head;
+    while (m) {
+        struct xmsg *next = m->next;
+        msg_unref(m->msg);
+        slab_free(m);
+        m = next;
+    }
+    if (srv->inbox.efd >= 0) close(srv->inbox.efd);
+    pthread_mutex_destroy(&srv->inbox.lock);
+}
+
+// ---------------- 熱重啟：把連線交給新的 process ----------------
+//
+// /restart 或 SIGUSR2：所有 shard 停下事件迴圈（io_uring 先靜止，見 uring_quiesce），main 再 fork：
+// parent 以同一個 pid exec self_path（部署時換掉的新版本會生效，supervisor 看到的 pid 也不變），
+// child 保留舊的狀態，經由 socketpair (AF_UNIX) 以 SCM_RIGHTS 把各 shard 的 listening socket 與
+// 每個 client 的 fd 傳過去，連同暱稱、協定、頻道、沒處理完的輸入與還沒送出的輸出，最後是重播用的
+// 最近廣播；新的 process 全部收完後回一個 byte，child 才結束。listening socket 全程開著，
+// 這段期間的新連線只是在 backlog 裡多等一下，已連線的 client 不會斷線，也不會漏掉或重複收到資料。
+//
+// 交接的資料（兩邊是同一台機器上的 process，整數直接用 host byte order）：
+//   struct handoff_hdr（附上 nlisten 個 listener fd）
+//   nrecent 筆 struct handoff_msg + len bytes 的訊息
+//   nclients 筆 struct handoff_client（附上 client fd）+ nrooms 個頻道名稱 + in / held / out 的內容
+
+struct handoff_hdr {
+    uint32_t magic;                    // HANDOFF_MAGIC
+    int32_t pid;                       // 送出狀態的 process，新的 process 收完後回收它
+    uint32_t nlisten, nrecent, nclients;
+};
+
+struct handoff_msg {
+    uint32_t sender, len;
+    uint8_t type, flags, label;
+};
+
+struct handoff_client {
+    int32_t shard;
+    uint32_t in_len;                   // 重組 buffer 中的半行（或半個 frame）
+    uint32_t held_len;                 // 超過速率限制時存起來、還沒處理的輸入
+    uint32_t out_len;                  // 輸出佇列中還沒送出的 bytes（已經是該 client 的協定格式）
+    uint8_t proto, nrooms;
+    char name[NAME_LEN];
+};
+
+static int write_full(int fd, const void *p, size_t n) {
+    const char *c = p;
+    while (n > 0) {
+        ssize_t w = write(fd, c, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        c += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *p, size_t n) {
+    char *c = p;
+    while (n > 0) {
+        ssize_t r = read(fd, c, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        c += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+// 送出 n bytes，第一個 byte 附上 nfds 個 fd (SCM_RIGHTS)
+static int send_fds(int sock, const void *p, size_t n, const int *fds, int nfds) {
+    char cbuf[CMSG_SPACE(sizeof(int) * (MAX_THREADS + 1))];
+    struct iovec iov = { (void *)p, n };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    memset(cbuf, 0, sizeof(cbuf));
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = cbuf;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(int) * (size_t)nfds);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * (size_t)nfds);
+    ssize_t w;
+    do w = sendmsg(sock, &mh, 0); while (w < 0 && errno == EINTR);
+    if (w <= 0) return -1;
+    return write_full(sock, (const char *)p + w, n - (size_t)w);
+}
+
+// 接收 n bytes 與附在上面的 fd（最多 maxfds 個，收到的 fd 設定 close-on-exec），回傳 fd 數，失敗回傳 -1
+// stream socket 上帶 fd 的資料不會和後面的資料合併成一次 recvmsg，所以標頭一定和它的 fd 一起收到
+static int recv_fds(int sock, void *p, size_t n, int *fds, int maxfds) {
+    char cbuf[CMSG_SPACE(sizeof(int) * (MAX_THREADS + 1))];
+    struct iovec iov = { p, n };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    ssize_t r;
+    do r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC); while (r < 0 && errno == EINTR);
+    if (r <= 0) return -1;
+    int nfds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int k = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int j = 0; j < k; j++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + j * sizeof(int), sizeof(int));
+            if (nfds < maxfds) fds[nfds++] = fd;
+            else               close(fd);
+        }
+    }
+    if ((mh.msg_flags & MSG_CTRUNC) ||
+        read_full(sock, (char *)p + r, n - (size_t)r) < 0) {
+        while (nfds > 0) close(fds[--nfds]);
+        return -1;
+    }
+    return nfds;
+}
+
+// 送出一個 client 的狀態（child 執行）
+static int handoff_send_client(int sock, struct server *srv, int i) {
+    struct outq *q = &srv->outq[i];
+    struct linebuf *lb = &srv->inbuf[i];
+    struct joined *j = &srv->joined[i];
+    struct handoff_client c;
+    memset(&c, 0, sizeof(c));
+    c.shard    = srv->id;
+    c.in_len   = (uint32_t)lb->len;
+    c.held_len = (uint32_t)lb->held_len;
+    c.out_len  = (uint32_t)q->bytes;
+    c.proto    = srv->proto[i];
+    c.nrooms   = (uint8_t)j->n;
+    memcpy(c.name, srv->names[i], NAME_LEN);
+    if (send_fds(sock, &c, sizeof(c), &srv->clients[i], 1) < 0) return -1;
+    for (int k = 0; k < j->n; k++) {
+        if (write_full(sock, j->refs[k].room->name, NAME_LEN) < 0) return -1;
+    }
+    if (write_full(sock, lb->buf, lb->len) < 0 || write_full(sock, lb->held, lb->held_len) < 0) return -1;
+    for (unsigned k = 0; k < q->count; k++) {
+        struct msgbuf *m = outq_at(q, k);
+        size_t off = k == 0 ? q->head_off : 0;
+        if (write_full(sock, m->data + off, m->len - off) < 0) return -1;
+    }
+    return 0;
+}
+
+// 把所有狀態送給新的 process，等它確認（child 執行），成功回傳 0
+static int handoff_send(int sock) {
+    struct handoff_hdr h;
+    int lfds[MAX_THREADS + 1];         // 每個 shard 的 TCP listener，加上 AF_UNIX listener
+    memset(&h, 0, sizeof(h));
+    h.magic   = HANDOFF_MAGIC;
+    h.pid     = (int32_t)getpid();
+    h.nlisten = (uint32_t)nshards + (shards[0].unix_fd >= 0);
+    h.nrecent = shards[0].nrecent;     // 每個 shard 都有一份所有的廣播，送 shard 0 的就好
+    for (int k = 0; k < nshards; k++) {
+        lfds[k] = shards[k].listen_fd;
+        for (int i = 0; i < shards[k].nslots; i++) h.nclients += shards[k].clients[i] > 0;
+    }
+    if (shards[0].unix_fd >= 0) lfds[nshards] = shards[0].unix_fd;
+    if (send_fds(sock, &h, sizeof(h), lfds, (int)h.nlisten) < 0) return -1;
+
+    struct server *s0 = &shards[0];
+    for (unsigned n = 0, k = (s0->recent_next + history_len - s0->nrecent) % (history_len ? history_len : 1);
+         n < s0->nrecent; n++, k = (k + 1) % history_len) {
+        struct msgbuf *m = s0->recent[k];
+        struct handoff_msg hm = { m->sender, (uint32_t)m->len, m->type, m->flags, m->label };
+        if (write_full(sock, &hm, sizeof(hm)) < 0 || write_full(sock, m->data, m->len) < 0) return -1;
+    }
+    for (int k = 0; k < nshards; k++) {
+        for (int i = 0; i < shards[k].nslots; i++) {
+            if (shards[k].clients[i] > 0 && handoff_send_client(sock, &shards[k], i) < 0) return -1;
+        }
+    }
+    char ack;
+    return read_full(sock, &ack, 1);
+}
+
+// 讀取並接上一個 client（新的 process 執行）；回傳 -1 表示交接資料中斷
+static int handoff_recv_client(int sock) {
+    struct handoff_client c;
+    int fd;
+    if (recv_fds(sock, &c, sizeof(c), &fd, 1) != 1) return -1;
+    c.name[NAME_LEN - 1] = '\0';
+    char rooms[ROOMS_PER_CLIENT][NAME_LEN];
+    char *data = NULL;
+    size_t total = (size_t)c.in_len + c.held_len + c.out_len;
+    if (c.nrooms > ROOMS_PER_CLIENT || c.in_len > BUF_SIZE - 1 || c.proto > PROTO_LZ4 ||
+        read_full(sock, rooms, (size_t)c.nrooms * NAME_LEN) < 0 ||
+        (total && !(data = malloc(total))) || read_full(sock, data, total) < 0) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+
+    struct server *srv = &shards[c.shard % nshards];
+    set_nonblocking(fd);               // 舊版本 io_uring 模式接受的 socket 是阻塞的
+    int i = add_client(srv, fd);
+    if (i >= 0) {
+        srv->proto[i] = c.proto;
+        // 預設名稱 anon<舊的 fd> 不能沿用（fd 編號變了），改用 add_client 給的新名稱
+        if (!nick_reserved(c.name) && nick_set(srv, i, c.name) < 0)
+            fprintf(stderr, "restart: nickname %s already taken\n", c.name);
+        // 頻道成員直接放回去，不再通知 "joined"
+        for (int k = 0; k < c.nrooms; k++) {
+            rooms[k][NAME_LEN - 1] = '\0';
+            struct room *r = room_find(srv, rooms[k]);
+            if (!r) r = room_create(srv, rooms[k]);
+            if (r && room_ref_of(srv, i, r) < 0 && room_add(srv, r, i) < 0 && r->nmembers == 0)
+                room_destroy(srv, r);
+        }
+        struct linebuf *lb = &srv->inbuf[i];
+        if (c.in_len && (lb->buf = slab_alloc(BUF_SIZE))) {
+            memcpy(lb->buf, data, c.in_len);
+            lb->len = c.in_len;
+        }
+        if (c.held_len) {              // 下一個 tick 由 rate_resume_due 接著處理
+            rate_hold(srv, i, data + c.in_len, c.held_len);
+            rate_pause(srv, i);
+        }
+        struct msgbuf *m;
+        if (c.out_len && (m = msg_new(data + c.in_len + c.held_len, c.out_len))) {
+            if (outq_append(&srv->outq[i], m) < 0) msg_unref(m);
+            else                                   mark_dirty(srv, i);
+        }
+        // 已經連線的 client 不再重播歷史訊息；還沒取暱稱的重新開始等 NICK
+        if (nick_reserved(srv->names[i])) timer_begin(srv, i);
+        else                              timer_arm(srv, i, TIMER_IDLE, idle_timeout);
+    }
+    free(data);
+    return 0;
+}
+
+// fd 是否為綁在 path（'@' 開頭為 abstract namespace）上的 AF_UNIX socket
+static int unix_bound_to(int fd, const char *path) {
+    struct sockaddr_un addr;
+    socklen_t alen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    if (!path || getsockname(fd, (struct sockaddr *)&addr, &alen) < 0 || addr.sun_family != AF_UNIX) return 0;
+    size_t n = alen - offsetof(struct sockaddr_un, sun_path);
+    if (path[0] == '@') return n == strlen(path) && addr.sun_path[0] == '\0' && !memcmp(addr.sun_path + 1, path + 1, n - 1);
+    return strncmp(addr.sun_path, path, sizeof(addr.sun_path)) == 0;
+}
+
+// 新的 process：讀取標頭與 listener（在 shard_init 之前），成功回傳 TCP listener 數。
+// AF_UNIX listener 另外放到 *unix_fd；這次啟動沒有 -U 或換了路徑時直接關掉，由 shard_init 重新建立
+static int handoff_recv_listeners(int sock, struct handoff_hdr *h, int *lfds, int *unix_fd) {
+    int n = recv_fds(sock, h, sizeof(*h), lfds, MAX_THREADS + 1);
+    if (n < 0 || h->magic != HANDOFF_MAGIC) {
+        fprintf(stderr, "restart: bad handoff data\n");
+        while (n > 0) close(lfds[--n]);
+        return -1;
+    }
+    int domain, ntcp = 0;
+    socklen_t dlen = sizeof(domain);
+    for (int k = 0; k < n; k++) {
+        if (getsockopt(lfds[k], SOL_SOCKET, SO_DOMAIN, &domain, &dlen) < 0 || domain != AF_UNIX) {
+            lfds[ntcp++] = lfds[k];
+        } else if (*unix_fd < 0 && unix_bound_to(lfds[k], unix_path)) {
+            *unix_fd = lfds[k];
+        } else {
+            close(lfds[k]);
+        }
+    }
+    return ntcp;
+}
+
+// 新的 process：shard 都初始化好之後接收最近廣播與所有 client，回覆確認並回收舊的 process
+static void handoff_recv(int sock, const struct handoff_hdr *h) {
+    unsigned restored = 0;
+    int ok = 1;
+    for (unsigned n = 0; ok && n < h->nrecent; n++) {
+        struct handoff_msg hm;
+        struct msgbuf *m = NULL;
+        if (read_full(sock, &hm, sizeof(hm)) < 0 || !(m = msg_alloc(hm.len)) ||
+            read_full(sock, m->data, hm.len) < 0) {
+            msg_unref(m);
+            ok = 0;
+            break;
+        }
+        m->len    = hm.len;
+        m->sender = hm.sender;
+        m->type   = hm.type;
+        m->flags  = hm.flags;
+        m->label  = hm.label;
+        m->born   = 0;
+        for (int k = 0; k < nshards; k++) recent_add(&shards[k], m);
+        msg_unref(m);
+    }
+    for (unsigned n = 0; ok && n < h->nclients; n++) {
+        if (handoff_recv_client(sock) < 0) ok = 0;
+        else                               restored++;
+    }
+    if (!ok) fprintf(stderr, "restart: handoff data truncated\n");
+    if (write_full(sock, "", 1) < 0) perror("restart: ack");
+    close(sock);
+    waitpid((pid_t)h->pid, NULL, 0);
+    printf("Restarted: took over %u of %u clients from pid %d\n", restored, h->nclients, (int)h->pid);
+}
+
+// exec 前把 keep 以外的 fd（stdin/stdout/stderr 除外）都設成 close-on-exec：
+// listener、client、epoll、io_uring 等都由 child 負責交接，不能留在新的 process 裡
+static void cloexec_all_but(int keep) {
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        int fd = atoi(e->d_name);
+        if (fd > 2 && fd != keep && fd != dirfd(d)) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    closedir(d);
+    fcntl(keep, F_SETFD, 0);
+}
+
+// 熱重啟（所有 thread 都已停下）：child 保留目前的狀態送給新的 process，parent exec 新的執行檔
+// 只有失敗時才會回傳，之後照一般的流程關閉 server
+static void hot_restart(void) {
+    // 各 shard 停下之前互相轉送、還沒處理的訊息先放進收件者的輸出佇列
+    for (int k = 0; k < nshards; k++) drain_inbox(&shards[k]);
+    for (int k = 0; k < nshards; k++) hist_sync(shards[k].hist);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        int rc = handoff_send(sv[1]);
+        if (rc < 0) fprintf(stderr, "restart: handoff to the new process failed\n");
+        for (int k = 0; k < nshards; k++) hist_close(shards[k].hist);
+        _exit(rc < 0);
+    }
+
+    close(sv[1]);
+    char env[16];
+    snprintf(env, sizeof(env), "%d", sv[0]);
+    setenv(HANDOFF_ENV, env, 1);
+    cloexec_all_but(sv[0]);
+    execv(self_path, self_argv);
+    perror(self_path);
+    unsetenv(HANDOFF_ENV);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [port] [-b epoll|uring|select] [-t threads] [-n max-clients]\n"
+                    "       [-L listen-backlog] [-U unix-path|@name] [-q queue-bytes] [-o drop-oldest|disconnect|coalesce]\n"
+                    "       [-R msgs-per-sec] [-B bytes-per-sec] [-I idle-seconds] [-N nick-seconds]\n"
+                    "       [-H replay-count] [-l log-dir] [-S segment-bytes] [-F fsync-ms]\n"
+                    "       [-M metrics-port]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    enum backend backend = BACKEND_EPOLL;
+
+    // 解析參數：-b 選擇事件迴圈 backend，-t 設定 worker thread 數，-n 設定 client 數上限，-L 設定 listen backlog，
+    // -U 另外開一個 AF_UNIX listener（'@' 開頭為 abstract namespace），
+    // -q/-o 設定每個 client 輸出佇列的上限與溢位時的處理方式，
+    // -M 開啟 metrics 的 HTTP port，-R/-B 設定每個 client 的接收速率，-I/-N 設定閒置送 PING 的秒數與送出 NICK 的期限，-H 設定新 client 連線時重播的廣播數，-l/-S/-F 設定歷史紀錄的目錄、segment 大小與 group commit 間隔
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:n:L:U:q:o:M:R:B:I:N:H:l:S:F:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "epoll") == 0)       backend = BACKEND_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)  backend = BACKEND_URING;
+            else if (strcmp(optarg, "select") == 0) backend = BACKEND_SELECT;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 't':
+            nshards = atoi(optarg);
+            if (nshards < 1 || nshards > MAX_THREADS) { usage(argv[0]); return 1; }
+            break;
+        case 'n':
+            max_clients = atoi(optarg);
+            if (max_clients < 1) { usage(argv[0]); return 1; }
+            break;
+        case 'L':
+            listen_backlog = atoi(optarg);
+            if (listen_backlog < 1) { usage(argv[0]); return 1; }
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 'q':
+            outq_limit = (size_t)strtoul(optarg, NULL, 10);
+            if (outq_limit == 0) { usage(argv[0]); return 1; }
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            if (metrics_port <= 0 || metrics_port > 65535) { usage(argv[0]); return 1; }
+            break;
+        case 'R':
+            rate_msgs = atoi(optarg);
+            if (rate_msgs < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'B':
+            rate_bytes = atoi(optarg);
+            if (rate_bytes < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'I':
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'N':
+            nick_timeout = atoi(optarg);
+            if (nick_timeout < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'H':
+            // 重播時所有訊息要能放進同一次 sendmsg
+            if (atoi(optarg) < 0 || atoi(optarg) > SEND_IOV) { usage(argv[0]); return 1; }
+            history_len = (unsigned)atoi(optarg);
+            break;
+        case 'l':
+            hist_dir = optarg;
+            break;
+        case 'S':
+            hist_segment = (size_t)strtoul(optarg, NULL, 10);
+            if (hist_segment < HIST_SEGMENT_MIN) { usage(argv[0]); return 1; }
+            break;
+        case 'F':
+            hist_sync_ms = atoi(optarg);
+            if (hist_sync_ms < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'o':
+            if (strcmp(optarg, "drop-oldest") == 0)     overflow_policy = OVERFLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "disconnect") == 0) overflow_policy = OVERFLOW_DISCONNECT;
+            else if (strcmp(optarg, "coalesce") == 0)   overflow_policy = OVERFLOW_COALESCE;
+            else { usage(argv[0]); return 1; }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // 讀取參數指定的 port，若無則使用 DEFAULT_PORT
+    int port = (optind < argc) ? atoi(argv[optind]) : DEFAULT_PORT;
+
+    linescan_init(); // 依 CPU 選擇行尾掃描的 SIMD 版本
+    raise_nofile();
+    check_somaxconn();
+
+    // 熱重啟要 exec 的執行檔：記下啟動時的路徑（之後被換成新版本也會 exec 到新的）
+    self_argv = argv;
+    ssize_t plen = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    self_path[plen > 0 ? plen : 0] = '\0';
+
+    // 由舊的 process exec 起來時，先收下 listener，之後 shard 直接沿用
+    struct handoff_hdr handoff;
+    int handoff_fd = -1, nlisten = 0, lfds[MAX_THREADS + 1], unix_lfd = -1;
+    if (getenv(HANDOFF_ENV)) {
+        handoff_fd = atoi(getenv(HANDOFF_ENV));
+        unsetenv(HANDOFF_ENV);
+        nlisten = handoff_recv_listeners(handoff_fd, &handoff, lfds, &unix_lfd);
+        if (nlisten < 0) {
+            close(handoff_fd);
+            handoff_fd = -1;
+            nlisten = 0;
+        }
+    }
+    handed_off = handoff_fd >= 0;
+
+    if (hist_dir && mkdir(hist_dir, 0755) < 0 && errno != EEXIST) {
+        perror(hist_dir);
+        return 1;
+    }
+
+    shards = calloc((size_t)nshards, sizeof(*shards));
+    if (!shards) { perror("calloc"); return 1; }
+    for (int k = 0; k < nshards; k++) {
+        shards[k].listen_fd = shards[k].unix_fd = shards[k].inbox.efd = -1;
+    }
+    for (int k = 0; k < nshards; k++) {
+        if (shard_init(&shards[k], k, port, backend, k < nlisten ? lfds[k] : -1, unix_lfd) < 0) {
+            if (handoff_fd >= 0 && k > 0) {
+                // 熱重啟中：舊的 process 已經把 client 交過來，不能因為多開的 shard 失敗就結束
+                // （例如 -t 變大，但舊版本的 listener 沒有 SO_REUSEPORT，新的 listener bind 不上去）。
+                // 改用已經初始化好的 k 個 shard，交接過來的 client 分給它們
+                fprintf(stderr, "restart: shard %d unavailable, running with %d thread%s\n",
+                        k, k, k > 1 ? "s" : "");
+                shard_close(&shards[k]);
+                if (k < nlisten) lfds[k] = -1; // 已由 shard_close 關閉
+                nshards = k;
+                break;
+            }
+            for (int j = 0; j <= k; j++) shard_close(&shards[j]);
+            free(shards);
+            return 1;
+        }
+    }
+    for (int k = nshards; k < nlisten; k++) {
+        if (lfds[k] >= 0) close(lfds[k]); // -t 變少了：多的 listener 不再使用
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = restart_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    static const char *const backend_names[] = { "epoll", "uring", "select" };
+    printf("Server listening on port %d (%s, %d thread%s, max %d clients) ... (/quit to stop)\n", port,
+           backend_names[shards[0].backend], nshards, nshards > 1 ? "s" : "", max_clients);
+    if (unix_path) printf("Also listening on unix socket %s (shared with TCP clients)\n", unix_path);
+    if (shards[0].backend == BACKEND_SELECT && max_clients > FD_SETSIZE)
+        fprintf(stderr, "warning: select() only handles fds below %d; use -b epoll or uring\n", FD_SETSIZE);
+    if (handoff_fd >= 0) handoff_recv(handoff_fd, &handoff);
+
+    // shard 0 在 main thread 執行，其他 shard 各開一個 thread
+    for (int k = 1; k < nshards; k++) {
+        if (pthread_create(&shards[k].thread, NULL, shard_main, &shards[k]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+    // 歷史紀錄的 group commit thread
+    pthread_t hist_thread;
+    int hist_started = hist_dir && hist_sync_ms > 0 &&
+                       pthread_create(&hist_thread, NULL, hist_sync_main, NULL) == 0;
+    // metrics thread
+    pthread_t metrics_thread;
+    int metrics_fd = metrics_port ? metrics_listen(metrics_port) : -1;
+    int metrics_started = metrics_fd >= 0 &&
+                          pthread_create(&metrics_thread, NULL, metrics_main, &metrics_fd) == 0;
+    if (metrics_started) printf("Metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+
+    shard_main(&shards[0]);
+    for (int k = 1; k < nshards; k++) pthread_join(shards[k].thread, NULL);
+    if (hist_started) pthread_join(hist_thread, NULL);
+    if (metrics_started) pthread_join(metrics_thread, NULL);
+    if (metrics_fd >= 0) close(metrics_fd);
+    if (restarting) hot_restart();     // 成功的話不會回來
 
     // --- 收尾，關閉所有 client 與 server socket ---
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i] > 0) close(clients[i]);
+    // 各 shard 的 slab 等全部關閉後才釋放：訊息可能由別的 shard 的 slab 配置
+    for (int k = 0; k < nshards; k++) shard_close(&shards[k]);
+    for (int k = 0; k < nshards; k++) {
+        slab_print_stats(&shards[k]);
+        slab_destroy(&shards[k].slab);
     }
-    close(server_fd);
+    free(shards);
+    free(nicks.tab);
     printf("Server exited.\n");
     return 0;
 }